@@ -39,102 +39,115 @@
 #include "buffer.h"
 #include "xmalloc.h"
 
-buffer_t buffer_create()
+/* Create a buffer holding at least size bytes */
+buffer_t buffer_create(size_t size)
 {
 	buffer_t b;
 
 	b = ALLOC(buffer);
-	b->bptr = b->dptr = NULL;
-	b->bsize = b->dsize = 0;
+
+	for(b->size = 1; b->size < size; b->size <<= 1);
+
+	b->data = (uint8_t *)xmalloc(b->size);
+	b->mask = b->size - 1;
+	b->head = b->tail = 0;
 
 	return b;
 }
 
 void buffer_destroy(buffer_t b)
 {
-	buffer_flush(b);
+	xfree(b->data);
 	xfree(b);
 }
 
-ssize_t buffer_prepend(buffer_t b, void *buffer, size_t nbytes)
+/* Return the largest contiguous region of buffered data */
+size_t buffer_peek(buffer_t b, void **ptr)
 {
-	uint8_t *t;
+	size_t n, offset = b->head & b->mask;
 
-	t = xmalloc(nbytes + b->dsize);
-	memcpy(t, buffer, nbytes);
-	memcpy(t + nbytes, b->dptr, b->dsize);
-	xfree(b->bptr);
+	n = b->size - offset;
+	if(n > b->tail - b->head)
+		n = b->tail - b->head;
 
-	b->bptr = b->dptr = t;
-	b->dsize += nbytes;
-	b->bsize = b->dsize;
+	*ptr = b->data + offset;
 
-	return nbytes;
+	return n;
 }
 
-ssize_t buffer_add(buffer_t b, void *buffer, size_t nbytes)
+void buffer_consume(buffer_t b, size_t nbytes)
 {
-	if(nbytes < 1)
-		return 0;
+	b->head += nbytes;
 
-	if(b->bptr == NULL) {
-		b->bptr = (uint8_t *)xmalloc(nbytes);
+	/* Rewind an empty buffer so the next reserve is as large as possible */
+	if(b->head == b->tail)
+		b->head = b->tail = 0;
+}
 
-		b->dptr = b->bptr;
-		b->bsize = b->dsize = nbytes;
+/* Return the largest contiguous region of free space */
+size_t buffer_reserve(buffer_t b, void **ptr)
+{
+	size_t n, offset = b->tail & b->mask;
 
-		memcpy(b->bptr, buffer, nbytes);
+	n = b->size - offset;
+	if(n > buffer_space(b))
+		n = buffer_space(b);
 
-		return nbytes;
-	}
+	*ptr = b->data + offset;
+
+	return n;
+}
+
+void buffer_commit(buffer_t b, size_t nbytes)
+{
+	b->tail += nbytes;
+}
 
-	if(b->bsize != b->dsize && (b->bsize - b->dsize - (b->dptr - b->bptr)) < nbytes) 
-		b->bptr = (uint8_t *)xrealloc(b->bptr, b->dsize + nbytes);
+ssize_t buffer_add(buffer_t b, const void *buffer, size_t nbytes)
+{
+	size_t n, c = 0;
+	void *ptr;
+
+	while(c < nbytes && (n = buffer_reserve(b, &ptr)) > 0) {
+		if(n > nbytes - c)
+			n = nbytes - c;
 
-	memmove(b->bptr, b->dptr, b->dsize);
-	memcpy(b->bptr + b->dsize, buffer, nbytes);
-	b->dsize += nbytes;
-	b->dptr = b->bptr;
+		memcpy(ptr, (const uint8_t *)buffer + c, n);
+		buffer_commit(b, n);
+		c += n;
+	}
 
-	return nbytes;
+	return c;
 }
 
 ssize_t buffer_get(buffer_t b, void *buffer, size_t nbytes)
 {
-	int ret;
+	size_t n, c = 0;
+	void *ptr;
 
-	if(b->dsize == 0)
-		return 0;
+	while(c < nbytes && (n = buffer_peek(b, &ptr)) > 0) {
+		if(n > nbytes - c)
+			n = nbytes - c;
 
-	if(nbytes >= b->dsize) {
-		memcpy(buffer, b->dptr, b->dsize);
-		ret = b->dsize;
-		xfree(b->bptr);
-		b->bptr = b->dptr = NULL;
-		b->bsize = b->dsize = 0;
-
-		return ret;
+		memcpy((uint8_t *)buffer + c, ptr, n);
+		buffer_consume(b, n);
+		c += n;
 	}
 
-	memcpy(buffer, b->dptr, nbytes);
-	b->dptr += nbytes;
-	b->dsize -= nbytes;
-
-	return nbytes;
+	return c;
 }
 
 size_t buffer_size(buffer_t b)
 {
-	return b->dsize;
+	return b->tail - b->head;
 }
 
-void buffer_flush(buffer_t b)
+size_t buffer_space(buffer_t b)
 {
-	if(b->bptr != NULL) {
-		xfree(b->bptr);
-		b->bptr = NULL;
-	}
+	return b->size - (b->tail - b->head);
+}
 
-	b->dptr = NULL;
-	b->bsize = b->dsize = 0;
+void buffer_flush(buffer_t b)
+{
+	b->head = b->tail = 0;
 }
@@ -35,19 +35,31 @@
 #define _BUFFER_H
 
 #include <sys/types.h>
+#include <inttypes.h>
 
+/* A buffer is a fixed capacity ring.  Capacity is always a power of two so
+   that the free-running head and tail offsets can be reduced with a mask.
+   Data may be accessed in place: buffer_peek() and buffer_reserve() return
+   the largest contiguous readable and writable regions respectively, which
+   are then released with buffer_consume() and buffer_commit(). */
 typedef struct buffer {
-	uint8_t *bptr, *dptr;
-	size_t bsize, dsize;
+	uint8_t *data;
+	size_t size, mask;
+	size_t head, tail;
 } *buffer_t;
 
-buffer_t buffer_create();
+buffer_t buffer_create(size_t size);
 void buffer_destroy(buffer_t b);
 
-ssize_t buffer_prepend(buffer_t b, void *buffer, size_t nbytes);
-ssize_t buffer_add(buffer_t b, void *buffer, size_t nbytes);
+size_t buffer_peek(buffer_t b, void **ptr);
+void buffer_consume(buffer_t b, size_t nbytes);
+size_t buffer_reserve(buffer_t b, void **ptr);
+void buffer_commit(buffer_t b, size_t nbytes);
+
+ssize_t buffer_add(buffer_t b, const void *buffer, size_t nbytes);
 ssize_t buffer_get(buffer_t b, void *buffer, size_t nbytes);
 size_t buffer_size(buffer_t b);
+size_t buffer_space(buffer_t b);
 void buffer_flush(buffer_t b);
 
 #endif
@@ -41,21 +41,56 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "connect.h"
+#include "deadline.h"
+#include "evloop.h"
 #include "fd.h"
 #include "modem.h"
 #include "output.h"
+#include "xmalloc.h"
 
 #define MODEM_INIT_ATTEMPTS	3
 #define MODEM_DIAL_ATTEMPTS	1
 
-fd_t connect_serial(void *cd)
+/* CONNECT_TIMEOUT defines (in milliseconds) how long we wait for a TCP
+   connection to any of the datalogger's addresses to be established.  It can
+   be overridden with the CONNECT_TIMEOUT environment variable. */
+#define CONNECT_TIMEOUT		10000
+
+/* CONNECT_STAGGER defines (in milliseconds) how long an attempt on one
+   address runs on its own before the next address is tried alongside it. */
+#define CONNECT_STAGGER		250
+
+/* CONNECT_MAX_ADDRESSES limits how many addresses are attempted at once */
+#define CONNECT_MAX_ADDRESSES	8
+
+/* RESOLVER_CACHE_TTL defines (in seconds) how long a resolved hostname is
+   reused for reconnection attempts before it is looked up again. */
+#define RESOLVER_CACHE_TTL	300
+
+struct resolver_entry {
+	char *hostname;
+	int port;
+	struct addrinfo *ai;
+	int64_t expires;
+	struct resolver_entry *next;
+};
+
+static struct resolver_entry *resolver_cache = NULL;
+
+fd_t connect_serial(void *cd, deadline_t deadline)
 {
-	return fd_init_serial(((struct serial_cd *)cd)->device);
+	struct serial_cd *scd = (struct serial_cd *)cd;
+
+	(void)deadline;
+
+	return fd_init_serial(scd->device, scd->baud);
 }
 
-fd_t connect_modem(void *cd)
+fd_t connect_modem(void *cd, deadline_t deadline)
 {
 	int i = 0;
 	struct modem_cd *mcd = (struct modem_cd *)cd;
@@ -64,7 +99,7 @@ fd_t connect_modem(void *cd)
 	fd_t fd;
 
 	print("Opening port %s... ", mcd->device);
-	if((m = modem_init(mcd->device)) == NULL) { 
+	if((m = modem_init(mcd->device, mcd->baud)) == NULL) { 
 		perror(mcd->device); 
 		fatal("Error #101: Couldn't open modem device\n");
 		return NULL;
@@ -76,7 +111,8 @@ fd_t connect_modem(void *cd)
 	print("Initializing modem... ");
 	fflush(stdout);
 	while(modem_reset(m) < 0) {
-		if(i++ > MODEM_INIT_ATTEMPTS) {
+		/* The pause before the next attempt has to fit before the deadline */
+		if(i++ > MODEM_INIT_ATTEMPTS || (deadline != 0 && deadline_remaining(deadline) < 5000)) {
 			fatal("Error #102: Couldn't reset modem\n");
 			return NULL;
 			//exit(EXIT_FAILURE);
@@ -86,7 +122,7 @@ fd_t connect_modem(void *cd)
 		modem_destroy(m);
 		sleep(5);
 
-		if((m = modem_init(mcd->device)) == NULL) {
+		if((m = modem_init(mcd->device, mcd->baud)) == NULL) {
 			perror(mcd->device);
 			fatal("Error #103: Couldn't initialize modem\n");
 			return NULL;
@@ -101,7 +137,7 @@ fd_t connect_modem(void *cd)
 		if(i++ != 0 && i <= MODEM_DIAL_ATTEMPTS)
 			sleep(5);
 
-		if(i > MODEM_DIAL_ATTEMPTS) {
+		if(i > MODEM_DIAL_ATTEMPTS || (deadline != 0 && deadline_expired(deadline))) {
 			fatal("Error #104: Too many dialing attempts, giving up!\n");
 			return NULL;
 			//exit(EXIT_FAILURE);
@@ -109,11 +145,11 @@ fd_t connect_modem(void *cd)
 
 		print("Dialing %s... ", mcd->number);
 		fflush(stdout);
-	} while(modem_dial(m, mcd->number) != 0);
+	} while(modem_dial(m, mcd->number, deadline) != 0);
 
 	print("connected.\n");
 
-	if((fd = fd_init_modem(m)) == NULL) {
+	if((fd = fd_init_modem(m, mcd->baud)) == NULL) {
 		return NULL;
 	}
 
@@ -122,36 +158,254 @@ fd_t connect_modem(void *cd)
 	return fd;
 }
 
-fd_t connect_tcpip(void *cd)
+/* Look up the addresses of a host, using the cache where possible */
+static struct addrinfo *resolve(char *hostname, int port)
 {
-	int fd;
+	struct resolver_entry **p, *e;
+	struct addrinfo hints, *ai;
+	char service[16];
+	int r;
+
+	for(p = &resolver_cache; (e = *p) != NULL; p = &e->next) {
+		if(e->port != port || strcmp(e->hostname, hostname))
+			continue;
+
+		if(monotonic_ms() < e->expires)
+			return e->ai;
+
+		*p = e->next;
+		freeaddrinfo(e->ai);
+		xfree(e->hostname);
+		xfree(e);
+		break;
+	}
 
-	struct sockaddr_in sin;
-	struct hostent *host;
-	struct tcpip_cd *tcd = (struct tcpip_cd *)cd;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
 
-	memset(&sin, 0, sizeof(struct sockaddr_in));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(tcd->port);
+	snprintf(service, sizeof(service), "%d", port);
 
-	if((sin.sin_addr.s_addr = inet_addr(tcd->hostname)) == INADDR_NONE) {
-		if((host = gethostbyname(tcd->hostname)) == NULL) {
-			fatal("Error #105: Couldn't resolve address %s\n", tcd->hostname);
-			exit(EXIT_FAILURE);
+	if((r = getaddrinfo(hostname, service, &hints, &ai)) != 0) {
+		print("Warning: %s\n", gai_strerror(r));
+		return NULL;
+	}
+
+	e = (struct resolver_entry *)xmalloc(sizeof(struct resolver_entry));
+	e->hostname = xstrdup(hostname);
+	e->port = port;
+	e->ai = ai;
+	e->expires = monotonic_ms() + RESOLVER_CACHE_TTL * 1000;
+	e->next = resolver_cache;
+	resolver_cache = e;
+
+	return ai;
+}
+
+/* Drop a cached lookup, e.g. because none of its addresses answered */
+static void resolve_forget(char *hostname, int port)
+{
+	struct resolver_entry **p, *e;
+
+	for(p = &resolver_cache; (e = *p) != NULL; p = &e->next) {
+		if(e->port == port && !strcmp(e->hostname, hostname)) {
+			*p = e->next;
+			freeaddrinfo(e->ai);
+			xfree(e->hostname);
+			xfree(e);
+			return;
 		}
+	}
+}
+
+/* The attempts connect_addrinfo() has in flight.  fd is the socket that
+   connected, or -1 while none has. */
+struct connect_attempts {
+	evloop_t loop;
+	struct addrinfo *ai;
+	int s[CONNECT_MAX_ADDRESSES];
+	int n, pending, stagger, fd;
+};
+
+static void connect_next(struct connect_attempts *c);
 
-		memcpy(&sin.sin_addr, host->h_addr, host->h_length);
+/* A socket finished connecting, successfully or not */
+static void connect_ready(int s, uint32_t events, void *arg)
+{
+	struct connect_attempts *c = (struct connect_attempts *)arg;
+	socklen_t len = sizeof(int);
+	int i, err;
+
+	(void)events;
+
+	evloop_remove(c->loop, s);
+	c->pending--;
+
+	if(getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+		c->fd = s;
+		evloop_stop(c->loop);
+		return;
 	}
 
-	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		print("Warning: System low on resources (couldn't create socket)\n");
-		return NULL;
+	for(i = 0; i < c->n; i++)
+		if(c->s[i] == s)
+			c->s[i] = -1;
+
+	close(s);
+
+	/* Nothing else is in flight, so there is no point waiting out the
+	   stagger before trying the next address */
+	if(c->pending == 0) {
+		evloop_timer_cancel(c->loop, c->stagger);
+		connect_next(c);
 	}
+}
+
+static void connect_stagger(void *arg)
+{
+	struct connect_attempts *c = (struct connect_attempts *)arg;
+
+	c->stagger = 0;
+	connect_next(c);
+}
+
+static void connect_timeout(void *arg)
+{
+	struct connect_attempts *c = (struct connect_attempts *)arg;
+
+	evloop_stop(c->loop);
+}
+
+/* Start an attempt on the next address that will take one, and arm the
+   stagger timer for the one after it.  Stops the loop once an attempt has
+   connected or none are left in flight. */
+static void connect_next(struct connect_attempts *c)
+{
+	struct addrinfo *ai;
+	int s;
+
+	c->stagger = 0;
+
+	while((ai = c->ai) != NULL && c->n < CONNECT_MAX_ADDRESSES) {
+		c->ai = ai->ai_next;
+
+		if((s = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+			continue;
 
-	if(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		if(connect(s, ai->ai_addr, ai->ai_addrlen) == 0) {
+			c->s[c->n++] = s;
+			c->fd = s;
+			break;
+		}
+
+		if(errno != EINPROGRESS || evloop_add(c->loop, s, EVLOOP_WRITE, connect_ready, c) < 0) {
+			close(s);
+			continue;
+		}
+
+		c->s[c->n++] = s;
+		c->pending++;
+
+		if(c->ai != NULL && c->n < CONNECT_MAX_ADDRESSES)
+			c->stagger = evloop_timer_add(c->loop, CONNECT_STAGGER, connect_stagger, c);
+
+		return;
+	}
+
+	evloop_stop(c->loop);
+}
+
+/* Connect to the first address that answers.  Attempts are started one
+   after another, CONNECT_STAGGER apart, and run in parallel on an event loop
+   until one of them succeeds or the timeout expires.  Returns a blocking
+   socket or -1. */
+static int connect_addrinfo(struct addrinfo *ai, int timeout)
+{
+	struct connect_attempts c;
+	int i;
+
+	if((c.loop = evloop_create()) == NULL)
+		return -1;
+
+	c.ai = ai;
+	c.n = c.pending = c.stagger = 0;
+	c.fd = -1;
+
+	evloop_timer_add(c.loop, timeout, connect_timeout, &c);
+	connect_next(&c);
+
+	if(c.fd < 0 && c.pending > 0)
+		evloop_run(c.loop);
+
+	for(i = 0; i < c.n; i++)
+		if(c.s[i] >= 0 && c.s[i] != c.fd)
+			close(c.s[i]);
+
+	evloop_destroy(c.loop);
+
+	if(c.fd >= 0 && fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) & ~O_NONBLOCK) < 0) {
+		close(c.fd);
+		return -1;
+	}
+
+	return c.fd;
+}
+
+/* Read an integer setting from the environment, if present */
+static void getenv_int(char *name, int *value)
+{
+	if(getenv(name) != NULL)
+		*value = atoi(getenv(name));
+}
+
+/* Socket options may be tuned per datalogger through the environment.
+   TCP_KEEPALIVE takes either 0 to disable keepalives or idle,interval,count
+   in seconds. */
+static void tcpip_opts(struct fd_tcp_opts *o)
+{
+	char *env;
+
+	fd_tcp_opts_default(o);
+
+	getenv_int("TCP_NODELAY", &o->nodelay);
+	getenv_int("TCP_QUICKACK", &o->quickack);
+	getenv_int("TCP_USER_TIMEOUT", &o->user_timeout);
+	getenv_int("TCP_RCVBUF", &o->rcvbuf);
+
+	if((env = getenv("TCP_KEEPALIVE")) != NULL) {
+		if(sscanf(env, "%d,%d,%d", &o->keepidle, &o->keepintvl, &o->keepcnt) == 3)
+			o->keepalive = 1;
+		else
+			o->keepalive = atoi(env);
+	}
+}
+
+fd_t connect_tcpip(void *cd, deadline_t deadline)
+{
+	int fd, timeout = CONNECT_TIMEOUT;
+
+	struct addrinfo *ai;
+	struct fd_tcp_opts opts;
+	struct tcpip_cd *tcd = (struct tcpip_cd *)cd;
+
+	if(getenv("CONNECT_TIMEOUT") != NULL && atoi(getenv("CONNECT_TIMEOUT")) > 0)
+		timeout = atoi(getenv("CONNECT_TIMEOUT"));
+
+	if((ai = resolve(tcd->hostname, tcd->port)) == NULL) {
+		fatal("Error #105: Couldn't resolve address %s\n", tcd->hostname);
+		exit(EXIT_FAILURE);
+	}
+
+	timeout = deadline_remaining(deadline_within(timeout, deadline));
+
+	if((fd = connect_addrinfo(ai, timeout)) < 0) {
 		print("Warning: Couldn't connect to %s:%d\n", tcd->hostname, tcd->port);
+		resolve_forget(tcd->hostname, tcd->port);
 		return NULL;
 	}
 
-	return fd_init_rawfd(fd);
+	tcpip_opts(&opts);
+
+	return fd_init_rawfd(fd, &opts);
 }
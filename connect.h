@@ -38,11 +38,13 @@
 
 struct serial_cd {
 	char *device;
+	int baud;
 };
 
 struct modem_cd {
 	char *device;
 	char *number;
+	int baud;
 };
 
 struct tcpip_cd {
@@ -50,8 +52,10 @@ struct tcpip_cd {
 	int port;
 };
 
-fd_t connect_serial(void *cd);
-fd_t connect_modem(void *cd);
-fd_t connect_tcpip(void *cd);
+/* Open a connection to the datalogger described by cd, giving up once the
+   deadline (0 for none) has passed */
+fd_t connect_serial(void *cd, deadline_t deadline);
+fd_t connect_modem(void *cd, deadline_t deadline);
+fd_t connect_tcpip(void *cd, deadline_t deadline);
 
 #endif
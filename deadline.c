@@ -0,0 +1,84 @@
+/*
+   deadline.c - Absolute monotonic deadlines for timed operations
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+
+#include "deadline.h"
+
+int64_t monotonic_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+deadline_t deadline_after(unsigned int msec)
+{
+	return monotonic_ms() + msec;
+}
+
+deadline_t deadline_min(deadline_t a, deadline_t b)
+{
+	return a < b ? a : b;
+}
+
+/* A deadline msec from now, but no later than limit (0 for no limit) */
+deadline_t deadline_within(unsigned int msec, deadline_t limit)
+{
+	deadline_t d = deadline_after(msec);
+
+	return limit != 0 ? deadline_min(d, limit) : d;
+}
+
+/* Milliseconds left until the deadline, suitable for passing to poll() */
+int deadline_remaining(deadline_t d)
+{
+	int64_t r = d - monotonic_ms();
+
+	if(r < 0)
+		return 0;
+
+	if(r > INT_MAX)
+		return INT_MAX;
+
+	return r;
+}
+
+int deadline_expired(deadline_t d)
+{
+	return monotonic_ms() >= d;
+}
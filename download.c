@@ -33,15 +33,23 @@
 
 #include <sys/types.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "connect.h"
+#include "deadline.h"
 #include "download.h"
 #include "fd.h"
 #include "format_data.h"
+#include "journal.h"
 #include "logger.h"
 #include "output.h"
+#include "range.h"
+#include "scan.h"
+#include "state.h"
 #include "xmalloc.h"
 
 
@@ -71,13 +79,132 @@
  */
 #define DOWNLOAD_CHUNK_SIZE	4096
 
-static logger_t cn_wrapper(fd_t (*connect)(void *cd), void *cd, char *security_code)
+/* DEADLINE_RESERVE is how many milliseconds of a download with a deadline
+   are kept back for saving the data and hanging up.  No piece is started
+   unless the throughput measured so far says it will be read before then. */
+#define DEADLINE_RESERVE	3000
+
+/* RETRY_PAUSE is how many milliseconds to wait before connecting again.
+   The wait doubles with every further connection, up to RETRY_PAUSE_MAX,
+   and never runs past the deadline. */
+#define RETRY_PAUSE		250
+#define RETRY_PAUSE_MAX		8000
+
+/* download_data() gives up with DOWNLOAD_OUT_OF_TIME when no further whole
+   array can be read before the deadline, so there is no point retrying */
+#define DOWNLOAD_OUT_OF_TIME	-2
+
+/* Time allowed for a download, and the throughput seen during it */
+struct budget {
+	deadline_t deadline;	/* 0 for no limit */
+	int64_t spent;		/* Milliseconds spent reading data */
+	int locations;		/* Locations read in that time */
+	int connects;		/* Connection attempts so far */
+};
+
+static void budget_init(struct budget *b, int seconds)
+{
+	b->deadline = seconds > 0 ? deadline_after(seconds * 1000) : 0;
+	b->spent = 0;
+	b->locations = 0;
+	b->connects = 0;
+}
+
+/* Milliseconds left for talking to the datalogger */
+static int budget_left(const struct budget *b)
+{
+	if(b->deadline == 0)
+		return INT_MAX;
+
+	return deadline_remaining(b->deadline) - DEADLINE_RESERVE;
+}
+
+/* Wait before every connection attempt but the first, so a logger that
+   can't be reached isn't hammered for as long as the deadline allows */
+static void budget_pause(struct budget *b)
+{
+	struct timespec ts;
+	int pause = RETRY_PAUSE, i;
+
+	if(b->connects++ == 0)
+		return;
+
+	for(i = 1; i < b->connects - 1 && pause < RETRY_PAUSE_MAX; i++)
+		pause *= 2;
+
+	if(pause > RETRY_PAUSE_MAX)
+		pause = RETRY_PAUSE_MAX;
+
+	if(pause > budget_left(b))
+		pause = budget_left(b);
+
+	if(pause <= 0)
+		return;
+
+	ts.tv_sec = pause / 1000;
+	ts.tv_nsec = pause % 1000 * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+/* When talking to the datalogger has to stop, 0 for no limit */
+static deadline_t budget_deadline(const struct budget *b)
+{
+	if(b->deadline == 0)
+		return 0;
+
+	return b->deadline - DEADLINE_RESERVE;
+}
+
+/* Whether to try again after a failure.  Against a deadline that is as long
+   as there is time left, otherwise a fixed number of times. */
+static int budget_retry(const struct budget *b, int failures)
+{
+	if(b->deadline != 0)
+		return budget_left(b) > 0;
+
+	return failures < MAX_FAILED_ATTEMPTS;
+}
+
+/* How many locations can be read in the given time at the throughput
+   measured so far, or -1 before there is a measurement */
+static int budget_fit(const struct budget *b, int left)
+{
+	int64_t fit;
+
+	if(b->locations == 0)
+		return -1;
+
+	if(left <= 0)
+		return 0;
+
+	if(b->spent <= 0)
+		return INT_MAX;
+
+	fit = (int64_t)left * b->locations / b->spent;
+
+	return fit > INT_MAX ? INT_MAX : fit;
+}
+
+/* Connect and get the datalogger's attention.  Every step, and every
+   exchange on the logger returned, ends by the budget's deadline, and
+   attempts after the first are paced by budget_pause(). */
+static logger_t cn_wrapper(fd_t (*connect)(void *cd, deadline_t deadline), void *cd, const struct download_opts *o, const struct state_entry *st, struct budget *b)
 {
 	int i = 0;
 	fd_t fd;
 	logger_t l;
 
-	while((fd = connect(cd)) == NULL) {
+	for(;;) {
+		budget_pause(b);
+
+		if((fd = connect(cd, budget_deadline(b))) != NULL)
+			break;
+
+		if(budget_left(b) <= 0) {
+			fatal("Error #207: Out of time connecting to datalogger\n");
+			return NULL;
+		}
+
 		if(i++ > MAX_CONNECT_ATTEMPTS) {
 			fatal("Error #201: Too many failed attempts to connect to datalogger... giving up!\n");
 			return NULL;
@@ -85,7 +212,12 @@ static logger_t cn_wrapper(fd_t (*connect)(void *cd), void *cd, char *security_c
 		}
 	}
 
-	while((l = logger_create(fd)) == NULL) {
+	while((l = logger_create(fd, budget_deadline(b))) == NULL) {
+		if(budget_left(b) <= 0) {
+			fatal("Error #207: Out of time connecting to datalogger\n");
+			return NULL;
+		}
+
 		if(i++ > MAX_CONNECT_ATTEMPTS) {
 			fatal("Error #202: Too many failed attempts to communicate with datalogger... giving up!\n");
 			return NULL;
@@ -93,64 +225,152 @@ static logger_t cn_wrapper(fd_t (*connect)(void *cd), void *cd, char *security_c
 		}
 	}
 
-	if(security_code != NULL)
-		logger_set_security_level(l, security_code);
+	if(st->valid)
+		logger_chunk_restore(l, st->rtt, st->chunk_size);
+
+	if(o->security_code != NULL)
+		logger_set_security_level(l, o->security_code);
 
 	return l;
 
 }
 
-static int download_data(uint8_t **bptr, logger_t l, int start, int end, int filled, int *downloaded)
+/* Drop the connection, keeping count of the exchanges it used */
+static void disconnect(logger_t *l, unsigned int *round_trips)
 {
-	int total, loc_to_read, loc_to_start, total_read, wrapped, show_bar=0;
-	uint8_t *buffer;
+	if(*l != NULL) {
+		*round_trips += (*l)->round_trips;
+		logger_destroy(*l);
+		*l = NULL;
+	}
+}
 
-	show_bar = (int)(getenv("HIDE_DOWNLOADBAR")==NULL);
+/* How many locations lie between start and end */
+static int download_total(int start, int end, int filled)
+{
+	struct range seg[RANGE_SEGMENTS];
 
-	if(start > end) 
-		total = filled - start + end - 1;
-	else
-		total = end - start;
+	return range_total(seg, range_split(start, end, filled, seg));
+}
 
-	if(start + *downloaded >= filled)
-		wrapped = 1;
-	else
-		wrapped = 0;
+/* Pick the next piece of the download, which never crosses the wrap of final
+   storage.  Oldest first, the downloaded locations are a prefix of the
+   download and the piece follows them.  Newest first, they are a suffix and
+   the piece comes just before them, ending on a whole number of arrays from
+   the end so each piece can be decoded on its own. */
+static const struct range *download_piece(const struct range *seg, int nseg, int total, int downloaded, int size, int lpa, int newest_first, int *offset, int *count)
+{
+	const struct range *r;
+	int first, last;
+
+	if(newest_first) {
+		if(lpa > 0 && size > lpa)
+			size -= size % lpa;
+
+		last = total - downloaded;
+		first = last - size;
+
+		if(first < 0)
+			first = 0;
+
+		if((r = range_find(seg, nseg, last - 1)) == NULL)
+			return NULL;
+
+		if(first < r->offset)
+			first = r->offset;
+	} else {
+		first = downloaded;
+		last = first + size;
+
+		if(last > total)
+			last = total;
+
+		if((r = range_find(seg, nseg, first)) == NULL)
+			return NULL;
+
+		if(last > r->offset + r->count)
+			last = r->offset + r->count;
+	}
+
+	*offset = first;
+	*count = last - first;
+
+	return r;
+}
+
+/* Work out how big the next piece may be to finish before the deadline.
+   The first piece is a single chunk to measure the throughput, and after
+   that pieces end on whole arrays so none of the time goes on data that
+   would be thrown away.  Returns 0 when nothing more fits. */
+static int download_budget(const struct budget *b, logger_t l, int downloaded, int lpa, int size)
+{
+	int left, fit;
+
+	if((left = budget_left(b)) <= 0)
+		return 0;
+
+	/* The throughput is an average, so allow for the round trip a short
+	   piece still takes */
+	if((fit = budget_fit(b, left - (l->chunk.rtt > 0 ? l->chunk.rtt : 0))) < 0)
+		return size < l->chunk.size ? size : l->chunk.size;
+
+	if(lpa > 0 && fit < INT_MAX - downloaded)
+		fit = (downloaded + fit) / lpa * lpa - downloaded;
+
+	debug("%d ms left, room for about %d more locations\n", left, fit);
+
+	return size < fit ? size : fit;
+}
+
+static int download_data(uint8_t **bptr, logger_t l, journal_t *j, struct budget *b, int start, int end, int filled, int lpa, int newest_first, int *downloaded)
+{
+	struct range seg[RANGE_SEGMENTS];
+	const struct range *r;
+	int nseg, total, size, offset, count, total_read, show_bar=0;
+	int64_t began;
+
+	show_bar = (int)(getenv("HIDE_DOWNLOADBAR")==NULL);
+
+	nseg = range_split(start, end, filled, seg);
+	total = range_total(seg, nseg);
 
 	if(*bptr == NULL) 
-		buffer = *bptr = (uint8_t *)xmalloc(total * 2);
+		*bptr = (uint8_t *)xmalloc(total * 2);
 
 	while(*downloaded < total) {
 		if(show_bar) draw_bar(*downloaded, total);
 
-		if(!wrapped) {
-			loc_to_start = start + *downloaded; 
+		/* With a journal every chunk is read and saved on its own, so
+		   little is lost if the download is interrupted */
+		if(*j != NULL && l->chunk.size < DOWNLOAD_CHUNK_SIZE)
+			size = l->chunk.size;
+		else
+			size = DOWNLOAD_CHUNK_SIZE;
+
+		if(b->deadline != 0 && (size = download_budget(b, l, *downloaded, lpa, size)) <= 0) {
+			if(show_bar) print("\n");
+			print("Out of time with %d of %d locations downloaded\n", *downloaded, total);
+			return DOWNLOAD_OUT_OF_TIME;
+		}
 
-			if(loc_to_start >= filled) {
-				wrapped = 1;
-				continue;
-			}
+		if((r = download_piece(seg, nseg, total, *downloaded, size, lpa, newest_first, &offset, &count)) == NULL)
+			return -1;
 
-			// DHX this does not make sense and i suspect it producing error as
-			// we are reading out of bounds.
-			//loc_to_read = filled - loc_to_start;
+		if(newest_first)
+			debug("Fetching locations %d-%d of %d\n", offset, offset + count, total);
 
-			if(start > end) {
-			loc_to_read = filled - loc_to_start;
-		} else {
-				loc_to_read = end - loc_to_start;
-			}
+		began = monotonic_ms();
 
-		} else {
-			loc_to_start = *downloaded - (filled - start) + 1;
-			loc_to_read = end - loc_to_start;
-		}
+		if((total_read = logger_read_data(l, *bptr + offset * 2, r->location + offset - r->offset, count)) < 0)
+			return -1;
 
-		if(loc_to_read > DOWNLOAD_CHUNK_SIZE)
-			loc_to_read = DOWNLOAD_CHUNK_SIZE;
+		b->spent += monotonic_ms() - began;
+		b->locations += total_read;
 
-		if((total_read = logger_read_data(l, *bptr + *downloaded * 2, loc_to_start, loc_to_read)) < 0)
-			return -1;
+		if(*j != NULL && journal_append(*j, offset, r->location + offset - r->offset, *bptr + offset * 2, total_read) < 0) {
+			journal_close(*j);
+			*j = NULL;
+		}
 
 		*downloaded += total_read;
 	}
@@ -163,54 +383,181 @@ static int download_data(uint8_t **bptr, logger_t l, int start, int end, int fil
 	return 0;
 }
 
-static int download(FILE *out, fd_t (*connect)(void *cd), void *cd, char *security_code, int clockupd, int user_start_location)
+/* The location holding the given offset into a download, or end for one
+   just past the last location */
+static int download_location(int start, int end, int filled, int offset)
+{
+	struct range seg[RANGE_SEGMENTS];
+	const struct range *r;
+	int nseg;
+
+	nseg = range_split(start, end, filled, seg);
+
+	if((r = range_find(seg, nseg, offset)) == NULL)
+		return end;
+
+	return r->location + offset - r->offset;
+}
+
+/* The location count locations on from start, skipping location filled
+   where the download wraps as range_split() does */
+static int download_advance(int start, int count, int filled)
+{
+	if(start + count <= filled)
+		return start + count;
+
+	return start + count - filled + 1;
+}
+
+/* Decide what to keep of a download that can't be finished.  Fetching the
+   newest data first, the arrays that start within what arrived are kept and
+   *first is set to the offset of the first of them.  Otherwise the whole
+   arrays from the start are kept and *end is moved back to just past them.
+   Returns how many locations are kept, or -1 if no more than least were
+   downloaded. */
+static int download_salvage(const uint8_t *buffer, int start, int *end, int filled, int lpa, int newest_first, int downloaded, int least, int *first)
+{
+	int total;
+
+	*first = 0;
+
+	if(downloaded <= least)
+		return -1;
+
+	if(newest_first) {
+		total = download_total(start, *end, filled);
+		*first = scan_next_header(buffer, total - downloaded, total);
+
+		return total - *first;
+	}
+
+	if(lpa <= 0)
+		return -1;
+
+	downloaded = downloaded / lpa * lpa;
+	*end = download_location(start, *end, filled, downloaded);
+
+	return downloaded;
+}
+
+/* Read the older locations a download that was cut short left behind, as
+   recorded in st, and write them out.  Whatever still can't be read stays
+   recorded for the next download. */
+static void download_backfill(FILE *out, logger_t l, struct budget *b, struct state_entry *st, int filled, int lpa, const struct download_opts *o)
+{
+	int start = st->gap_start, end, downloaded = 0, kept, first = 0;
+	uint8_t *buffer = NULL;
+	journal_t j = NULL;
+
+	end = download_advance(st->gap_start, st->gap_count, filled);
+
+	print("Downloading data missed earlier between locations %d and %d:\n", start, end);
+
+	if(download_data(&buffer, l, &j, b, start, end, filled, lpa, o->newest_first, &downloaded) == 0) {
+		kept = downloaded;
+		st->gap_count = 0;
+	} else if((kept = download_salvage(buffer, start, &end, filled, lpa, o->newest_first, downloaded, 0, &first)) < 0) {
+		kept = 0;
+	} else if(o->newest_first) {
+		/* What is still missing is the oldest part of the gap */
+		st->gap_count = first;
+	} else {
+		st->gap_start = end;
+		st->gap_count -= kept;
+	}
+
+	if(kept > 0) {
+		print("Saving %d of the %d locations missed earlier\n", kept, kept + st->gap_count);
+		process_data(out, buffer + first * 2, kept * 2, o->threads);
+	}
+
+	if(st->gap_count > 0)
+		print("Warning: %d older locations from %d are left for the next download\n", st->gap_count, st->gap_start);
+
+	xfree(buffer);
+}
+
+/* Where backing up one record from the end of a download lands: the last
+   array header among the count locations saved, which begin at offset
+   first of the download and run up to the end.  0 if there is none. */
+static int download_aligned_back(const uint8_t *data, int start, int end, int filled, int first, int count)
+{
+	size_t h;
+
+	if(count < 1 || (h = scan_prev_header(data, count)) == (size_t)count)
+		return 0;
+
+	return download_location(start, end, filled, first + h);
+}
+
+/* Download from the datalogger.  st holds what earlier sessions learnt about
+   it, and is updated with what this one found if the download succeeds. */
+static int download(FILE *out, fd_t (*connect)(void *cd, deadline_t deadline), void *cd, const char *key, const struct download_opts *o, struct state_entry *st)
 {
+	int clockupd = o->clockupd;
+	journal_t j = NULL;
 	int start_location, end_location, downloaded_locations = 0;
 	int reference_location, filled_locations, memory_pointer, locations_per_array;
+	int r = 0, first = 0, partial = 0, written, skip;
 	int skew = 0;
 	int failures = 0;
+	struct budget b;
+	unsigned int round_trips = 0;
 	uint8_t *buffer = NULL;
 
 	logger_t l = NULL;
 
-	while(failures < MAX_FAILED_ATTEMPTS) {
-		if(l != NULL)
-			logger_destroy(l);
+	/* Against a deadline the data comes first, and the clock is set with
+	   whatever time is left afterwards */
+	budget_init(&b, o->deadline);
 
-		l = cn_wrapper(connect, cd, security_code);
+	while(budget_retry(&b, failures)) {
+		disconnect(&l, &round_trips);
+
+		l = cn_wrapper(connect, cd, o, st, &b);
 
 		if(l == NULL) {
 			failures++;
 			continue;
 		}
 
-		if(clockupd) {
+		if(clockupd && b.deadline == 0) {
 			if(logger_update_clock(l, &skew) < 0) {
 				failures++;
-				logger_destroy(l);
+				disconnect(&l, &round_trips);
 				continue;
 			}
 
 			clockupd = 0;
 		}
 
-		if(logger_get_position(l, &reference_location, &filled_locations, &memory_pointer, &locations_per_array) < 0) {
+		if(logger_get_position(l, &reference_location, &filled_locations, &memory_pointer, NULL) < 0) {
+			failures++;
+			disconnect(&l, &round_trips);
+			continue;
+		}
+
+		/* The array length only changes with the logger's program, which
+		   would normally change how much memory is filled too */
+		if(st->valid && st->locations_per_array > 0 && st->filled_locations == filled_locations)
+			locations_per_array = st->locations_per_array;
+		else if(logger_get_array_length(l, memory_pointer, filled_locations, &locations_per_array) < 0) {
 			failures++;
-			logger_destroy(l);
+			disconnect(&l, &round_trips);
 			continue;
 		}
 
 		break;
 	} 
 
-	if(failures >= MAX_FAILED_ATTEMPTS) {
+	if(l == NULL) {
 		fatal("Error #203: Too many failed attempts to communicate with datalogger... giving up!\n");
 		return -1;
 	}
 
 	/* Normal operation */
-	if(user_start_location >= 0) 
-		start_location = user_start_location;
+	if(o->start_location >= 0) 
+		start_location = o->start_location;
 	else
 		start_location = reference_location + MAX_RECORD_SIZE;
 
@@ -219,38 +566,87 @@ static int download(FILE *out, fd_t (*connect)(void *cd), void *cd, char *securi
 	if(start_location > filled_locations)
 		start_location = 1;
 
-	while(l == NULL || logger_record_align(l, &start_location)) {
-		if(failures++ >= MAX_FAILED_ATTEMPTS) {
-			logger_destroy(l);
+	/* Older locations the last download was cut short before are only read
+	   when carrying on from where it ended, and only as far as the logger
+	   hasn't written over them since */
+	if(st->valid && st->gap_count > 0 && start_location == st->aligned_start && st->filled_locations == filled_locations) {
+		written = download_total(st->aligned_start, end_location, filled_locations);
+		skip = download_total(st->aligned_start, st->gap_start, filled_locations);
+
+		if(written > skip) {
+			print("Warning: %d older locations missed earlier were overwritten\n",
+					written - skip < st->gap_count ? written - skip : st->gap_count);
+
+			st->gap_start = download_advance(st->gap_start, written - skip, filled_locations);
+			st->gap_count -= written - skip;
+		}
+	} else
+		st->gap_count = 0;
+
+	if(st->gap_count <= 0)
+		st->gap_start = st->gap_count = 0;
+
+	/* Where the last download ended is the start of a record, and where
+	   backing up from it lands was found in the data it saved */
+	if(st->valid && start_location == st->aligned_start && st->filled_locations == filled_locations && st->aligned_back > 0)
+		start_location = st->aligned_back;
+	else while(l == NULL || logger_record_align(l, &start_location)) {
+		if(!budget_retry(&b, failures++)) {
+			disconnect(&l, &round_trips);
 			fatal("Error #204: Too many failed attempts to communicate with datalogger... giving up!\n");
 			return -1;
 		}
 
-		logger_destroy(l);
-		l = cn_wrapper(connect, cd, security_code);
+		disconnect(&l, &round_trips);
+		l = cn_wrapper(connect, cd, o, st, &b);
+	}
+
+	/* Pick up whatever an interrupted attempt at the same download saved */
+	if(o->journal_file != NULL) {
+		buffer = (uint8_t *)xmalloc(download_total(start_location, end_location, filled_locations) * 2);
+		j = journal_open(o->journal_file, key, filled_locations, start_location, buffer,
+				download_total(start_location, end_location, filled_locations), o->newest_first, &downloaded_locations);
 	}
 
 	print("Downloading data between locations %d and %d:\n", start_location, end_location);
 
-	while(l == NULL || download_data(&buffer, l, start_location, end_location, filled_locations, &downloaded_locations) < 0) {
+	while(l == NULL || (r = download_data(&buffer, l, &j, &b, start_location, end_location, filled_locations, locations_per_array, o->newest_first, &downloaded_locations)) < 0) {
+
 
+		if(r == DOWNLOAD_OUT_OF_TIME || !budget_retry(&b, failures++)) {
 
-		if(failures++ >= MAX_FAILED_ATTEMPTS) {
+			/* Against a deadline every whole array is worth saving */
+			if(b.deadline != 0 && downloaded_locations > 0 && r != DOWNLOAD_OUT_OF_TIME)
+				print("Out of time with %d locations downloaded\n", downloaded_locations);
 
-			if(downloaded_locations > 100) { // even though we failed to download all data, we still got some...
+			// even though we failed to download all data, we still got some...
+			if((downloaded_locations = download_salvage(buffer, start_location, &end_location, filled_locations,
+					locations_per_array, o->newest_first, downloaded_locations, b.deadline != 0 ? 0 : 100, &first)) >= 0) {
 
-				// try to remove incomplete arrays
+				/* Only the newest data arrived, so the older part is
+				   recorded to be read by the next download, which
+				   begins at the end.  An older part still missing
+				   from before is joined to it, at the cost of reading
+				   what lies between them again. */
+				if(o->newest_first && first > 0) {
+					if(st->gap_count == 0)
+						st->gap_start = start_location;
 
-				downloaded_locations = (downloaded_locations / locations_per_array) * locations_per_array;
-				end_location = (start_location + downloaded_locations) % filled_locations;
+					st->gap_count = download_total(st->gap_start, download_location(start_location, end_location, filled_locations, first), filled_locations);
 
-				print("Saving incomplete download (%d Locations)",downloaded_locations);
+					if(o->state_file == NULL)
+						print("Warning: Without a state file the %d older locations are lost\n", st->gap_count);
+				}
+
+				print("Saving incomplete download (%d Locations)\n",downloaded_locations);
+				partial = 1;
 
 				break;
 
 			} else {
 
-				logger_destroy(l);
+				disconnect(&l, &round_trips);
+				journal_close(j);
 				xfree(buffer);
 				fatal("Error #205: Too many failed attempts to communicate with datalogger... giving up!\n");
 				return -1;
@@ -258,14 +654,46 @@ static int download(FILE *out, fd_t (*connect)(void *cd), void *cd, char *securi
 			}
 		}
 
-		logger_destroy(l);
-		l = cn_wrapper(connect, cd, security_code);
+		disconnect(&l, &round_trips);
+		l = cn_wrapper(connect, cd, o, st, &b);
 	}
 
     // print("start_loc: %d  end_loc: %d  filled_loc: %d  downl_loc: %d \n", start_location, end_location, filled_locations, downloaded_locations);
 
-	process_data(out, buffer, downloaded_locations * 2);
-	logger_destroy(l);
+	st->memory_pointer = memory_pointer;
+	st->filled_locations = filled_locations;
+	st->locations_per_array = locations_per_array;
+	st->aligned_start = end_location;
+	st->aligned_back = download_aligned_back(buffer + first * 2, start_location, end_location, filled_locations, first, downloaded_locations);
+
+	/* The older locations missed earlier go out first, so the output stays
+	   in the order the data was logged */
+	if(l != NULL && !partial && st->gap_count > 0)
+		download_backfill(out, l, &b, st, filled_locations, locations_per_array, o);
+
+	process_data(out, buffer + first * 2, downloaded_locations * 2, o->threads);
+
+	if(l != NULL && clockupd && b.deadline != 0) {
+		if(budget_left(&b) <= 0)
+			print("Warning: No time left to update the datalogger's clock\n");
+		else if(logger_update_clock(l, &skew) < 0)
+			print("Warning: Couldn't update the datalogger's clock before the deadline\n");
+	}
+
+	if(l != NULL) {
+		logger_chunk_report(l);
+
+		st->rtt = l->chunk.rtt;
+		/* Failures this time say little about the next session, so
+		   what is kept is the largest size reached, not where the
+		   failures left it */
+		st->chunk_size = l->chunk.largest;
+	}
+
+	disconnect(&l, &round_trips);
+	journal_remove(j);
+
+	print("%u round trips to the datalogger\n", round_trips);
 	xfree(buffer);
 
 
@@ -275,26 +703,60 @@ static int download(FILE *out, fd_t (*connect)(void *cd), void *cd, char *securi
 }
 
 
-int download_serial(FILE *out, char *device, char *security_code, int clockupd, int start_location)
+/* Load what is known about the logger with the given key, then download */
+static int download_with_state(FILE *out, fd_t (*connect)(void *cd, deadline_t deadline), void *cd, const char *key, int *baud, const struct download_opts *o)
+{
+	struct state_entry st;
+	int end_location;
+
+	memset(&st, 0, sizeof(st));
+
+	if(o->state_file != NULL) {
+		state_load(o->state_file, key, &st);
+
+		if(*baud == 0 && st.baud > 0)
+			*baud = st.baud;
+	}
+
+	end_location = download(out, connect, cd, key, o, &st);
+
+	if(end_location >= 0 && o->state_file != NULL) {
+		st.baud = *baud;
+		state_save(o->state_file, key, &st);
+	}
+
+	return end_location;
+}
+
+int download_serial(FILE *out, char *device, int baud, const struct download_opts *o)
 {
 	struct serial_cd scd;
+	char key[STATE_KEY_SIZE];
+
+	snprintf(key, sizeof(key), "serial:%s", device);
+
 	scd.device = device;
+	scd.baud = baud;
 
-	return download(out, connect_serial, &scd, security_code, clockupd, start_location);
+	return download_with_state(out, connect_serial, &scd, key, &scd.baud, o);
 }
 
-int download_modem(FILE *out, char *number, char *device, char *security_code, int clockupd, int start_location)
+int download_modem(FILE *out, char *number, char *device, int baud, const struct download_opts *o)
 {
 	struct modem_cd mcd;
+	char key[STATE_KEY_SIZE];
 	int retval;
         modem_t m;
 
+	snprintf(key, sizeof(key), "modem:%s", number);
+
 	mcd.device = device;
 	mcd.number = number;
+	mcd.baud = baud;
 
-	retval = download(out, connect_modem, &mcd, security_code, clockupd, start_location);
+	retval = download_with_state(out, connect_modem, &mcd, key, &mcd.baud, o);
 
-	if((m = modem_init(device)) == NULL) {
+	if((m = modem_init(device, mcd.baud)) == NULL) {
 			perror(device);
 			fatal("Error #206: Couldn't open modem device to terminate connection\n");
 			exit(EXIT_FAILURE);
@@ -307,12 +769,25 @@ int download_modem(FILE *out, char *number, char *device, char *security_code, i
 
 }
 
-int download_tcpip(FILE *out, char *hostname, int port, char *security_code, int clockupd, int start_location)
+int download_tcpip(FILE *out, char *hostname, int port, const struct download_opts *o)
 {
 	struct tcpip_cd tcd;
+	char key[STATE_KEY_SIZE];
+	int baud = 0;
+
+	snprintf(key, sizeof(key), "tcp:%s:%d", hostname, port);
 
 	tcd.hostname = hostname;
 	tcd.port = port;
 
-	return download(out, connect_tcpip, &tcd, security_code, clockupd, start_location);
+	return download_with_state(out, connect_tcpip, &tcd, key, &baud, o);
+}
+
+/* Download over connections made by the caller, such as one end of
+   fd_init_mem().  key names the datalogger in the state file. */
+int download_connect(FILE *out, fd_t (*connect)(void *cd, deadline_t deadline), void *cd, const char *key, const struct download_opts *o)
+{
+	int baud = 0;
+
+	return download_with_state(out, connect, cd, key, &baud, o);
 }
@@ -36,8 +36,23 @@
 
 #include <stdio.h>
 
-int download_serial(FILE *out, char *device, char *security_code, int clockupd, int start_location);
-int download_modem(FILE *out, char *number, char *device, char *security_code, int clockupd, int start_location);
-int download_tcpip(FILE *out, char *hostname, int port, char *security_code, int clockupd, int start_location);
+#include "fd.h"
+
+/* What to do during a download, common to all connection types */
+struct download_opts {
+	char *security_code;	/* NULL to leave the security level alone */
+	int clockupd;		/* Update the datalogger's clock */
+	int start_location;	/* -1 to start at the oldest data */
+	char *state_file;	/* Per-logger state database, or NULL */
+	char *journal_file;	/* Spool for resuming interrupted downloads */
+	int newest_first;	/* Fetch the most recent arrays before older ones */
+	int deadline;		/* Seconds the whole download may take, 0 for no limit */
+	int threads;		/* Threads to decode the data with */
+};
+
+int download_serial(FILE *out, char *device, int baud, const struct download_opts *o);
+int download_modem(FILE *out, char *number, char *device, int baud, const struct download_opts *o);
+int download_tcpip(FILE *out, char *hostname, int port, const struct download_opts *o);
+int download_connect(FILE *out, fd_t (*connect)(void *cd, deadline_t deadline), void *cd, const char *key, const struct download_opts *o);
 
 #endif
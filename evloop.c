@@ -0,0 +1,288 @@
+/*
+   evloop.c - Readiness callbacks and timers on top of epoll
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "deadline.h"
+#include "evloop.h"
+#include "xmalloc.h"
+
+/* EVLOOP_MAX_EVENTS defines how many ready descriptors are collected with a
+ * single call to epoll_wait().  Any beyond this are picked up on the next
+ * iteration. */
+#define EVLOOP_MAX_EVENTS	32
+
+static struct evloop_io *evloop_find(evloop_t e, int fd)
+{
+	struct evloop_io *io;
+
+	for(io = e->io; io != NULL; io = io->next)
+		if(io->fd == fd)
+			return io;
+
+	return NULL;
+}
+
+/* Free descriptors removed while their events were being dispatched */
+static void evloop_reap(evloop_t e)
+{
+	struct evloop_io *io;
+
+	while((io = e->dead) != NULL) {
+		e->dead = io->next;
+		xfree(io);
+	}
+}
+
+evloop_t evloop_create()
+{
+	evloop_t e = ALLOC(evloop);
+
+	if((e->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		xfree(e);
+		return NULL;
+	}
+
+	e->running = 0;
+	e->timer_id = 0;
+	e->io = e->dead = NULL;
+	e->timers = NULL;
+
+	return e;
+}
+
+void evloop_destroy(evloop_t e)
+{
+	struct evloop_io *io;
+	struct evloop_timer *t;
+
+	while((io = e->io) != NULL) {
+		e->io = io->next;
+		xfree(io);
+	}
+
+	while((t = e->timers) != NULL) {
+		e->timers = t->next;
+		xfree(t);
+	}
+
+	evloop_reap(e);
+	close(e->epfd);
+	xfree(e);
+}
+
+/* Register a descriptor.  The callback is invoked each time one of the
+   requested events is ready, until the descriptor is removed. */
+int evloop_add(evloop_t e, int fd, uint32_t events, evloop_io_cb cb, void *arg)
+{
+	struct epoll_event ev;
+	struct evloop_io *io;
+
+	if(evloop_find(e, fd) != NULL) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	io = (struct evloop_io *)xmalloc(sizeof(struct evloop_io));
+	io->fd = fd;
+	io->events = events;
+	io->cb = cb;
+	io->arg = arg;
+
+	ev.events = events;
+	ev.data.ptr = io;
+
+	if(epoll_ctl(e->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		xfree(io);
+		return -1;
+	}
+
+	io->next = e->io;
+	e->io = io;
+
+	return 0;
+}
+
+int evloop_modify(evloop_t e, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	struct evloop_io *io;
+
+	if((io = evloop_find(e, fd)) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	ev.events = events;
+	ev.data.ptr = io;
+
+	if(epoll_ctl(e->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		return -1;
+
+	io->events = events;
+
+	return 0;
+}
+
+int evloop_remove(evloop_t e, int fd)
+{
+	struct evloop_io **p, *io;
+
+	for(p = &e->io; *p != NULL; p = &(*p)->next)
+		if((*p)->fd == fd)
+			break;
+
+	if((io = *p) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*p = io->next;
+
+	epoll_ctl(e->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+	/* Events for this descriptor may still be pending in the current
+	   dispatch, so it is released only once that has finished */
+	io->fd = -1;
+	io->next = e->dead;
+	e->dead = io;
+
+	return 0;
+}
+
+/* Arm a one-shot timer.  Returns an identifier for evloop_timer_cancel() */
+int evloop_timer_add(evloop_t e, unsigned int msec, evloop_timer_cb cb, void *arg)
+{
+	struct evloop_timer **p, *t;
+
+	t = (struct evloop_timer *)xmalloc(sizeof(struct evloop_timer));
+	t->id = ++e->timer_id;
+	t->when = deadline_after(msec);
+	t->cb = cb;
+	t->arg = arg;
+
+	/* Timers are kept sorted by expiry */
+	for(p = &e->timers; *p != NULL && (*p)->when <= t->when; p = &(*p)->next);
+
+	t->next = *p;
+	*p = t;
+
+	return t->id;
+}
+
+void evloop_timer_cancel(evloop_t e, int id)
+{
+	struct evloop_timer **p, *t;
+
+	for(p = &e->timers; *p != NULL; p = &(*p)->next) {
+		if((*p)->id == id) {
+			t = *p;
+			*p = t->next;
+			xfree(t);
+			return;
+		}
+	}
+}
+
+/* Wait up to msec milliseconds (-1 for no limit) for events and dispatch
+   them.  Returns the number of callbacks run, or -1 on error. */
+int evloop_run_once(evloop_t e, int msec)
+{
+	struct epoll_event events[EVLOOP_MAX_EVENTS];
+	struct evloop_io *io;
+	struct evloop_timer *t;
+	deadline_t now;
+	int i, n, c = 0;
+
+	if(e->timers != NULL) {
+		now = monotonic_ms();
+
+		if(e->timers->when <= now)
+			msec = 0;
+		else if(msec < 0 || e->timers->when - now < msec)
+			msec = e->timers->when - now;
+	}
+
+	if((n = epoll_wait(e->epfd, events, EVLOOP_MAX_EVENTS, msec)) < 0) {
+		if(errno != EINTR)
+			return -1;
+
+		n = 0;
+	}
+
+	for(i = 0; i < n; i++) {
+		io = (struct evloop_io *)events[i].data.ptr;
+
+		if(io->fd < 0)
+			continue;
+
+		io->cb(io->fd, events[i].events, io->arg);
+		c++;
+	}
+
+	evloop_reap(e);
+
+	now = monotonic_ms();
+	while((t = e->timers) != NULL && t->when <= now) {
+		e->timers = t->next;
+		t->cb(t->arg);
+		xfree(t);
+		c++;
+	}
+
+	return c;
+}
+
+/* Dispatch events until evloop_stop() is called or nothing is left to wait for */
+int evloop_run(evloop_t e)
+{
+	e->running = 1;
+
+	while(e->running && (e->io != NULL || e->timers != NULL))
+		if(evloop_run_once(e, -1) < 0)
+			return -1;
+
+	e->running = 0;
+
+	return 0;
+}
+
+void evloop_stop(evloop_t e)
+{
+	e->running = 0;
+}
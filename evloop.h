@@ -0,0 +1,88 @@
+/*
+   evloop.h - Readiness callbacks and timers on top of epoll
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <inttypes.h>
+
+#include "deadline.h"
+
+#define EVLOOP_READ	EPOLLIN
+#define EVLOOP_WRITE	EPOLLOUT
+#define EVLOOP_ERROR	(EPOLLERR | EPOLLHUP)
+
+typedef void (*evloop_io_cb)(int fd, uint32_t events, void *arg);
+typedef void (*evloop_timer_cb)(void *arg);
+
+struct evloop_io {
+	int fd;
+	uint32_t events;
+	evloop_io_cb cb;
+	void *arg;
+	struct evloop_io *next;
+};
+
+struct evloop_timer {
+	int id;
+	deadline_t when;
+	evloop_timer_cb cb;
+	void *arg;
+	struct evloop_timer *next;
+};
+
+/* An event loop lets one thread wait on many descriptors at once, calling
+   back as each becomes ready, with one-shot timers alongside */
+typedef struct evloop {
+	int epfd, running, timer_id;
+	struct evloop_io *io, *dead;
+	struct evloop_timer *timers;
+} *evloop_t;
+
+evloop_t evloop_create();
+void evloop_destroy(evloop_t e);
+
+int evloop_add(evloop_t e, int fd, uint32_t events, evloop_io_cb cb, void *arg);
+int evloop_modify(evloop_t e, int fd, uint32_t events);
+int evloop_remove(evloop_t e, int fd);
+
+int evloop_timer_add(evloop_t e, unsigned int msec, evloop_timer_cb cb, void *arg);
+void evloop_timer_cancel(evloop_t e, int id);
+
+int evloop_run_once(evloop_t e, int msec);
+int evloop_run(evloop_t e);
+void evloop_stop(evloop_t e);
+
+#endif
@@ -32,8 +32,12 @@
  */
 
 #include <sys/types.h>
-#include <sys/time.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,17 +48,134 @@
 #include <errno.h>
 
 #include "buffer.h"
+#include "deadline.h"
+#include "evloop.h"
 #include "modem.h"
 #include "fd.h"
+#include "tty.h"
 #include "xmalloc.h"
 #include "output.h"
 
-fd_t fd_init_serial(char *device)
+/* FD_BUFFER_SIZE defines the capacity of the receive buffer attached to each
+ * descriptor.  Reads smaller than half of this go through the buffer so that
+ * following small reads don't cost a system call each. */
+#define FD_BUFFER_SIZE		4096
+
+/* FD_MAX_IOV defines the largest number of buffers fd_writev() accepts */
+#define FD_MAX_IOV		8
+
+/* Operations common to all descriptor based transports */
+static ssize_t fd_sys_write(fd_t f, const struct iovec *iov, int iovcnt)
+{
+	return writev(f->fd, iov, iovcnt);
+}
+
+/* Wait for the descriptor to become readable.  Returns 1 if it is, 0 if the
+   deadline passed first and -1 on error */
+static int fd_sys_wait(fd_t f, deadline_t deadline)
+{
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = f->fd;
+	pfd.events = POLLIN;
+
+	while((r = poll(&pfd, 1, deadline_remaining(deadline))) < 0 && errno == EINTR);
+
+	return r;
+}
+
+static ssize_t fd_sys_pending(fd_t f)
+{
+	int n;
+
+	if(ioctl(f->fd, FIONREAD, &n) < 0)
+		return -1;
+
+	return n;
+}
+
+/* Serial lines and modems */
+static ssize_t fd_tty_read(fd_t f, const struct iovec *iov, int iovcnt, size_t want)
+{
+	tty_read_size(f->fd, &f->rtio, want);
+
+	return readv(f->fd, iov, iovcnt);
+}
+
+static int fd_tty_flush(fd_t f)
+{
+	return tcflush(f->fd, TCIOFLUSH);
+}
+
+static void fd_tty_close(fd_t f)
+{
+	tcsetattr(f->fd, TCSANOW, &f->tio);
+	close(f->fd);
+}
+
+/* Stream sockets.  There is no tcflush() for sockets, so flushing reads and
+   discards whatever has already arrived. */
+static ssize_t fd_sock_read(fd_t f, const struct iovec *iov, int iovcnt, size_t want)
+{
+	/* Sockets hand over whatever has arrived; there is nothing to tune */
+	(void)want;
+
+	return readv(f->fd, iov, iovcnt);
+}
+
+static int fd_sock_flush(fd_t f)
+{
+	char buf[256];
+	ssize_t r;
+
+	while((r = recv(f->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0);
+
+	if(r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		return -1;
+
+	return 0;
+}
+
+static void fd_sock_close(fd_t f)
+{
+	close(f->fd);
+}
+
+/* TCP connections are sockets which may need quick ACK mode rearmed, as
+   Linux clears it again on its own */
+static ssize_t fd_tcp_read(fd_t f, const struct iovec *iov, int iovcnt, size_t want)
+{
+	ssize_t ret = readv(f->fd, iov, iovcnt);
+
+	(void)want;
+
+	if(ret > 0 && f->quickack)
+		setsockopt(f->fd, IPPROTO_TCP, TCP_QUICKACK, &f->quickack, sizeof(f->quickack));
+
+	return ret;
+}
+
+static const struct fd_ops fd_tty_ops = {
+	fd_tty_read, fd_sys_write, fd_tty_flush, fd_sys_wait, fd_sys_pending, fd_tty_close
+};
+
+static const struct fd_ops fd_sock_ops = {
+	fd_sock_read, fd_sys_write, fd_sock_flush, fd_sys_wait, fd_sys_pending, fd_sock_close
+};
+
+static const struct fd_ops fd_tcp_ops = {
+	fd_tcp_read, fd_sys_write, fd_sock_flush, fd_sys_wait, fd_sys_pending, fd_sock_close
+};
+
+/* Open a directly attached datalogger.  A baud rate of 0 keeps the line
+   speed the device is already set to. */
+fd_t fd_init_serial(char *device, int baud)
 {
 	fd_t f = ALLOC(fd);
-	struct termios newtio;
 
-	f->type = 1;
+	f->ops = &fd_tty_ops;
+	f->quickack = 0;
 
 	if((f->fd = open(device, O_RDWR | O_NOCTTY)) < 0) {
 		perror(device);
@@ -73,30 +194,25 @@ fd_t fd_init_serial(char *device)
 		return NULL;
 	}
 
-	if(tcgetattr(f->fd, &newtio) < 0) {
-		xfree(f);
-		return NULL;
-	}
-
-	newtio.c_cflag |= CLOCAL | CREAD;
-	newtio.c_iflag &= ~(IXON|IXOFF|IXANY);
-	newtio.c_iflag &= ~(INLCR|IGNCR|ICRNL);
-	newtio.c_lflag &= ~(ICANON|ECHO|ECHOE|ISIG);
+	if(tty_raw(f->fd, &f->rtio, baud) < 0) {
+		if(baud > 0)
+			print("Error: Unsupported line speed %d\n", baud);
 
-	if(tcsetattr(f->fd, TCSANOW, &newtio) < 0) {
 		xfree(f);
 		return NULL;
 	}
 
-	f->b = buffer_create();
+	tty_low_latency(f->fd);
+
+	f->b = buffer_create(FD_BUFFER_SIZE);
+	f->loop = NULL;
 
 	return f;
 }
 
-fd_t fd_init_modem(modem_t m)
+fd_t fd_init_modem(modem_t m, int baud)
 {
 	fd_t f;
-	struct termios newtio;
 
 	if(tcsetattr(m->fd, TCSANOW, &m->tio) < 0) 
 		return NULL;
@@ -111,102 +227,212 @@ fd_t fd_init_modem(modem_t m)
 		return NULL;
 
 	f = ALLOC(fd);
+	f->ops = &fd_tty_ops;
 	f->fd = m->fd;
-	f->type = 1;
+	f->quickack = 0;
 
 	if(tcgetattr(f->fd, &f->tio) < 0) {
 		xfree(f);
 		return NULL;
 	}
 
-	if(tcgetattr(f->fd, &newtio) < 0) {
+	if(tty_raw(f->fd, &f->rtio, baud) < 0) {
 		xfree(f);
 		return NULL;
 	}
 
-	newtio.c_cflag |= CLOCAL | CREAD;
-	newtio.c_iflag &= ~(IXON|IXOFF|IXANY);
-	newtio.c_iflag &= ~(INLCR|IGNCR|ICRNL); 
-	newtio.c_lflag &= ~(ICANON|ECHO|ECHOE|ISIG);
-
-	if(tcsetattr(f->fd, TCSANOW, &newtio) < 0) {
+	/* Reads are only issued once poll() reports data, so the descriptor
+	   can block, which lets VMIN/VTIME batch incoming bytes */
+	if(fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_NDELAY) < 0) {
 		xfree(f);
 		return NULL;
 	}
 
-	f->b = buffer_create();
+	tty_low_latency(f->fd);
+
+	f->b = buffer_create(FD_BUFFER_SIZE);
+	f->loop = NULL;
 
 	return f;
 }
 
-fd_t fd_init_rawfd(int descriptor)
+void fd_tcp_opts_default(struct fd_tcp_opts *o)
+{
+	o->nodelay = 1;
+	o->quickack = 1;
+	o->keepalive = 1;
+	o->keepidle = 10;
+	o->keepintvl = 5;
+	o->keepcnt = 3;
+	o->user_timeout = 30000;
+	o->rcvbuf = 0;
+}
+
+static void fd_setsockopt(int descriptor, int level, int option, int value, char *name)
+{
+	if(setsockopt(descriptor, level, option, &value, sizeof(value)) < 0)
+		print("Warning: Couldn't set %s on socket\n", name);
+}
+
+/* Wrap a connected socket.  If o isn't NULL, the descriptor is a TCP
+   connection and the given options are applied to it. */
+fd_t fd_init_rawfd(int descriptor, const struct fd_tcp_opts *o)
 {
 	fd_t f;
 
 	f = ALLOC(fd);
+	f->ops = &fd_sock_ops;
 	f->fd = descriptor;
-	f->type = 0;
-	f->b = buffer_create();
+	f->quickack = 0;
+	f->b = buffer_create(FD_BUFFER_SIZE);
+	f->loop = NULL;
+
+	if(o == NULL)
+		return f;
+
+	f->ops = &fd_tcp_ops;
+
+	fd_setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, o->nodelay, "TCP_NODELAY");
+
+	if(o->keepalive) {
+		fd_setsockopt(descriptor, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+		fd_setsockopt(descriptor, IPPROTO_TCP, TCP_KEEPIDLE, o->keepidle, "TCP_KEEPIDLE");
+		fd_setsockopt(descriptor, IPPROTO_TCP, TCP_KEEPINTVL, o->keepintvl, "TCP_KEEPINTVL");
+		fd_setsockopt(descriptor, IPPROTO_TCP, TCP_KEEPCNT, o->keepcnt, "TCP_KEEPCNT");
+	}
+
+	if(o->user_timeout > 0)
+		fd_setsockopt(descriptor, IPPROTO_TCP, TCP_USER_TIMEOUT, o->user_timeout, "TCP_USER_TIMEOUT");
+
+	if(o->rcvbuf > 0)
+		fd_setsockopt(descriptor, SOL_SOCKET, SO_RCVBUF, o->rcvbuf, "SO_RCVBUF");
+
+	if(o->quickack) {
+		fd_setsockopt(descriptor, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+		f->quickack = 1;
+	}
 
 	return f;
 }
 
+/* Create an in-memory connection.  The returned fd_t is one end of a socket
+   pair and *peer receives the other, so a simulated datalogger can drive the
+   protocol code without any hardware involved. */
+fd_t fd_init_mem(int *peer)
+{
+	int sv[2];
+
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return NULL;
+
+	*peer = sv[1];
+
+	return fd_init_rawfd(sv[0], NULL);
+}
+
 void fd_destroy(fd_t f)
 {
+	fd_detach(f);
 	buffer_destroy(f->b);
-	if(f->type) 
-		tcsetattr(f->fd, TCSANOW, &f->tio);
-	close(f->fd);
+	f->ops->close(f);
 	// DHX valgrind says that the f is never freed... so we free it here
 	xfree(f);
 }
 
-ssize_t fd_read_raw(fd_t f, void *buffer, size_t nbytes, unsigned int seconds)
+static void fd_dispatch(int descriptor, uint32_t events, void *arg)
 {
-	ssize_t ret, c = 0, t;
-	int8_t *bptr = (int8_t *)buffer;
+	fd_t f = (fd_t)arg;
 
-	fd_set fds;
-	struct timeval tv;
+	(void)descriptor;
 
-	if((c = buffer_size(f->b)) > 0) {
-		if(c >= nbytes)
-			return buffer_get(f->b, buffer, nbytes);
+	f->cb(f, events, f->arg);
+}
 
-		buffer_get(f->b, bptr, c);
-		nbytes -= c;
-		bptr += c;
-	}
+/* Register with an event loop, so one thread can service several sessions.
+   The callback should take what fd_buffer_count() reports rather than wait,
+   and since bytes already in the receive buffer raise no further events, it
+   should drain that too before returning. */
+int fd_attach(fd_t f, evloop_t e, uint32_t events, fd_event_cb cb, void *arg)
+{
+	fd_detach(f);
 
-	tv.tv_sec = seconds;
-	tv.tv_usec = 0;
+	f->cb = cb;
+	f->arg = arg;
 
-	FD_ZERO(&fds);
-	FD_SET(f->fd, &fds);
+	if(evloop_add(e, f->fd, events, fd_dispatch, f) < 0)
+		return -1;
 
-	if((t = select(f->fd + 1, &fds, NULL, NULL, &tv)) < 1) {
-		if(c > 0)
-			return c;
+	f->loop = e;
 
+	return 0;
+}
+
+void fd_detach(fd_t f)
+{
+	if(f->loop == NULL)
+		return;
+
+	evloop_remove(f->loop, f->fd);
+	f->loop = NULL;
+}
+
+/* Wait for the descriptor to become readable, then read as much as will fit
+   into the receive buffer.  want is the number of bytes the caller needs,
+   which serial lines use to decide how long to keep collecting. */
+static ssize_t fd_fill(fd_t f, size_t want, deadline_t deadline)
+{
+	struct iovec iov;
+	ssize_t ret;
+
+	if((iov.iov_len = buffer_reserve(f->b, &iov.iov_base)) == 0)
+		return 0;
+
+	if(f->ops->wait(f, deadline) < 1)
 		return -1;
+
+	if((ret = f->ops->read(f, &iov, 1, want < iov.iov_len ? want : iov.iov_len)) < 1)
+		return -1;
+
+	buffer_commit(f->b, ret);
+
+	return ret;
+}
+
+ssize_t fd_read_raw(fd_t f, void *buffer, size_t nbytes, deadline_t deadline)
+{
+	struct iovec iov;
+	ssize_t ret;
+
+	if(buffer_size(f->b) > 0)
+		return buffer_get(f->b, buffer, nbytes);
+
+	/* Small reads are served through the receive buffer */
+	if(nbytes < FD_BUFFER_SIZE / 2) {
+		if(fd_fill(f, nbytes, deadline) < 0)
+			return -1;
+
+		return buffer_get(f->b, buffer, nbytes);
 	}
 
-	if((ret = read(f->fd, bptr, nbytes)) < 0) {
-		if(c > 0)
-			return c;
+	if(f->ops->wait(f, deadline) < 1)
+		return -1;
+
+	iov.iov_base = buffer;
+	iov.iov_len = nbytes;
 
+	if((ret = f->ops->read(f, &iov, 1, nbytes)) < 1)
 		return -1;
-	}
 
-	return c + ret;
+	return ret;
 }
 
-int fd_read(fd_t f, void *buffer, size_t nbytes, unsigned int seconds)
+/* Read exactly nbytes, failing if they haven't all arrived by the deadline */
+int fd_read(fd_t f, void *buffer, size_t nbytes, deadline_t deadline)
 {
 	int c;
 
 	while(nbytes > 0) {
-		if((c = fd_read_raw(f, buffer, nbytes, seconds)) < 0)
+		if((c = fd_read_raw(f, buffer, nbytes, deadline)) < 0)
 			return -1;
 
 		buffer += c;
@@ -218,81 +444,186 @@ int fd_read(fd_t f, void *buffer, size_t nbytes, unsigned int seconds)
 
 ssize_t fd_write(fd_t f, const void *buffer, size_t nbytes)
 {
-	return write(f->fd, buffer, nbytes);
+	struct iovec iov;
+
+	iov.iov_base = (void *)buffer;
+	iov.iov_len = nbytes;
+
+	return f->ops->write(f, &iov, 1);
 }
 
-int fd_flush(fd_t f)
+/* Step over n bytes of an iovec array, adjusting the first partially
+   consumed entry in place.  Shared with the modem code, which writes to the
+   modem device before an fd_t exists for it. */
+void fd_iov_advance(struct iovec **iov, int *iovcnt, size_t n)
 {
-	return tcflush(f->fd, TCIOFLUSH);
+	struct iovec *vp = *iov;
+	int i;
+
+	for(i = 0; i < *iovcnt && n >= vp[i].iov_len; i++)
+		n -= vp[i].iov_len;
+
+	vp += i;
+	*iovcnt -= i;
+
+	if(*iovcnt > 0) {
+		vp->iov_base = (uint8_t *)vp->iov_base + n;
+		vp->iov_len -= n;
+	}
+
+	*iov = vp;
 }
 
-ssize_t fd_read_line(fd_t f, char *buffer, size_t nbytes, unsigned int seconds)
+/* Write several buffers as one unit.  Normally this takes a single system
+   call, so a command and its line terminator leave in the same segment. */
+ssize_t fd_writev(fd_t f, const struct iovec *iov, int iovcnt)
 {
-	int c, n;
-	char *bptr, *eptr;
+	struct iovec v[FD_MAX_IOV], *vp = v;
+	ssize_t ret, total = 0;
+
+	if(iovcnt > FD_MAX_IOV) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	bptr = buffer;
-	n = nbytes - 1;
+	memcpy(v, iov, iovcnt * sizeof(struct iovec));
 
-	memset(buffer, '\0', nbytes);
+	while(iovcnt > 0) {
+		if((ret = f->ops->write(f, vp, iovcnt)) < 0) {
+			if(errno == EINTR)
+				continue;
 
-	do {
-		if((c = fd_read_raw(f, bptr, n, seconds)) < 0) 
 			return -1;
+		}
 
-		if((eptr = strpbrk(bptr, "\r\n")) != NULL) {
-			if(eptr[1] == '\n')
-				buffer_add(f->b, eptr + 2, c - (eptr - bptr + 2));
-			else
-				buffer_add(f->b, eptr + 1, c - (eptr - bptr + 1));
+		total += ret;
 
-			*eptr = '\0';
+		/* Skip whatever was written, in case of a short write */
+		fd_iov_advance(&vp, &iovcnt, ret);
+	}
 
-			return 0;
-		}
+	return total;
+}
+
+int fd_flush(fd_t f)
+{
+	buffer_flush(f->b);
+
+	return f->ops->flush(f);
+}
 
-		bptr += c;
-		n -= c;
-	} while(n > 0);
+/* Read into several buffers.  Data already held in the receive buffer is
+   returned first; otherwise the data is read straight into the caller's
+   buffers, bypassing the receive buffer.  Returns the number of bytes read. */
+ssize_t fd_readv_raw(fd_t f, const struct iovec *iov, int iovcnt, deadline_t deadline)
+{
+	ssize_t ret = 0;
+	size_t total = 0;
+	int i;
 
-#ifdef DEBUG
-	debug("Warning: Buffer full during serial read");
-#endif
+	for(i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
 
-	return 0;
+	if(buffer_size(f->b) > 0) {
+		for(i = 0; i < iovcnt && buffer_size(f->b) > 0; i++)
+			ret += buffer_get(f->b, iov[i].iov_base, iov[i].iov_len);
+
+		return ret;
+	}
+
+	if(f->ops->wait(f, deadline) < 1)
+		return -1;
+
+	if((ret = f->ops->read(f, iov, iovcnt, total)) < 1)
+		return -1;
+
+	return ret;
 }
 
-ssize_t fd_buffer_count(fd_t f)
+/* Fill every buffer completely, failing if the data hasn't all arrived by
+   the deadline */
+int fd_readv(fd_t f, const struct iovec *iov, int iovcnt, deadline_t deadline)
 {
+	struct iovec v[FD_MAX_IOV], *vp = v;
 	ssize_t ret;
 
-	if(ioctl(f->fd, FIONREAD, &ret) < 0)
+	if(iovcnt > FD_MAX_IOV) {
+		errno = EINVAL;
 		return -1;
+	}
 
-	return buffer_size(f->b) + ret;
+	memcpy(v, iov, iovcnt * sizeof(struct iovec));
+
+	/* Drop empty entries so a completed read leaves nothing behind */
+	fd_iov_advance(&vp, &iovcnt, 0);
 
+	while(iovcnt > 0) {
+		if((ret = fd_readv_raw(f, vp, iovcnt, deadline)) < 0)
+			return -1;
+
+		fd_iov_advance(&vp, &iovcnt, ret);
+	}
+
+	return 0;
 }
 
-ssize_t fd_buffer_count_tm(fd_t s, unsigned int seconds)
+/* Discard input up to and including the character c.  Returns the number of
+   bytes discarded, 0 if c wasn't found within limit bytes, or -1 if the
+   deadline passed or the read failed. */
+ssize_t fd_scan(fd_t f, int c, size_t limit, deadline_t deadline)
 {
-	fd_set f;
-	struct timeval tv;
+	size_t n = 0, len;
+	uint8_t *p, *cp;
+
+	while(n < limit) {
+		if((len = buffer_peek(f->b, (void **)&p)) == 0) {
+			if(fd_fill(f, 1, deadline) < 0)
+				return -1;
 
-	tv.tv_sec = seconds;
-	tv.tv_usec = 0;
+			continue;
+		}
 
-	FD_ZERO(&f);
-	FD_SET(s->fd, &f);
+		if(len > limit - n)
+			len = limit - n;
 
-	if(select(s->fd + 1, &f, NULL, NULL, &tv) < 0) 
-		return -1; 
+		if((cp = memchr(p, c, len)) != NULL) {
+			buffer_consume(f->b, cp - p + 1);
+			return n + (cp - p + 1);
+		}
 
-	if(!FD_ISSET(s->fd, &f)) { 
-#ifdef DEBUG
-		debug("Warning: Timeout during serial read"); 
-#endif
-		return -1; 
+		buffer_consume(f->b, len);
+		n += len;
 	}
 
-	return fd_buffer_count(s);
+	return 0;
+}
+
+/* Return a pointer to received data without copying it, waiting for some to
+   arrive if nothing is buffered.  The data stays buffered until it is
+   released with fd_consume(). */
+ssize_t fd_peek(fd_t f, void **data, deadline_t deadline)
+{
+	size_t len;
+
+	while((len = buffer_peek(f->b, data)) == 0) {
+		if(fd_fill(f, 1, deadline) < 0)
+			return -1;
+	}
+
+	return len;
+}
+
+void fd_consume(fd_t f, size_t nbytes)
+{
+	buffer_consume(f->b, nbytes);
+}
+
+ssize_t fd_buffer_count(fd_t f)
+{
+	ssize_t ret;
+
+	if((ret = f->ops->pending(f)) < 0)
+		return -1;
+
+	return buffer_size(f->b) + ret;
 }
@@ -35,28 +35,73 @@
 #define FD_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 
 #include "modem.h"
 #include "buffer.h"
+#include "deadline.h"
+#include "evloop.h"
+
+struct fd;
+
+typedef void (*fd_event_cb)(struct fd *f, uint32_t events, void *arg);
+
+/* A transport moves bytes for an fd_t.  read is only called once wait has
+   reported data; want is how many bytes the caller needs, which transports
+   that can batch input may use to decide how long to keep collecting.
+   pending returns the number of bytes that can be read without waiting. */
+struct fd_ops {
+	ssize_t (*read)(struct fd *f, const struct iovec *iov, int iovcnt, size_t want);
+	ssize_t (*write)(struct fd *f, const struct iovec *iov, int iovcnt);
+	int (*flush)(struct fd *f);
+	int (*wait)(struct fd *f, deadline_t deadline);
+	ssize_t (*pending)(struct fd *f);
+	void (*close)(struct fd *f);
+};
+
+/* Socket options applied to TCP connections.  The datalogger protocol is a
+   long chain of small command/response exchanges, so by default Nagle and
+   delayed ACKs are disabled and dead peers are detected quickly. */
+struct fd_tcp_opts {
+	int nodelay, quickack;
+	int keepalive, keepidle, keepintvl, keepcnt;
+	int user_timeout;	/* milliseconds, 0 for the system default */
+	int rcvbuf;		/* bytes, 0 for the system default */
+};
 
 typedef struct fd {
-	int fd, type;
+	const struct fd_ops *ops;
+	int fd, quickack;
 	buffer_t b;
-	struct termios tio;
+	struct termios tio, rtio;
+
+	evloop_t loop;		/* Event loop registered with, if any */
+	fd_event_cb cb;
+	void *arg;
 } *fd_t;
 
-fd_t fd_init_serial(char *device);
-fd_t fd_init_modem(modem_t m);
-fd_t fd_init_rawfd(int fd);
+fd_t fd_init_serial(char *device, int baud);
+fd_t fd_init_modem(modem_t m, int baud);
+fd_t fd_init_rawfd(int fd, const struct fd_tcp_opts *o);
+fd_t fd_init_mem(int *peer);
+void fd_tcp_opts_default(struct fd_tcp_opts *o);
 void fd_destroy(fd_t s);
 
-ssize_t fd_read_raw(fd_t s, void *buffer, size_t nbytes, unsigned int seconds);
-int fd_read(fd_t s, void *buffer, size_t nbytes, unsigned int seconds);
-ssize_t fd_read_line(fd_t s, char *buffer, size_t nbytes, unsigned int seconds);
+int fd_attach(fd_t f, evloop_t e, uint32_t events, fd_event_cb cb, void *arg);
+void fd_detach(fd_t f);
+
+ssize_t fd_read_raw(fd_t s, void *buffer, size_t nbytes, deadline_t deadline);
+int fd_read(fd_t s, void *buffer, size_t nbytes, deadline_t deadline);
+ssize_t fd_readv_raw(fd_t s, const struct iovec *iov, int iovcnt, deadline_t deadline);
+int fd_readv(fd_t s, const struct iovec *iov, int iovcnt, deadline_t deadline);
+ssize_t fd_scan(fd_t s, int c, size_t limit, deadline_t deadline);
+ssize_t fd_peek(fd_t s, void **data, deadline_t deadline);
+void fd_consume(fd_t s, size_t nbytes);
 ssize_t fd_write(fd_t s, const void *buffer, size_t nbytes);
+ssize_t fd_writev(fd_t s, const struct iovec *iov, int iovcnt);
+void fd_iov_advance(struct iovec **iov, int *iovcnt, size_t n);
 int fd_flush(fd_t s);
 ssize_t fd_buffer_count(fd_t s);
-ssize_t fd_buffer_count_tm(fd_t s, unsigned int seconds);
 
 #endif
@@ -31,67 +31,98 @@
  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "format_data.h"
+#include "scan.h"
+#include "xmalloc.h"
 
-struct hrv {
-	int sign;
-	int mantissa;
-	uint8_t value;
+/* MAX_DECIMALS is the most digits after the decimal point a value is
+   printed with.  Hi-res values can claim up to seven, but those with more
+   than five have never been output. */
+#define MAX_DECIMALS	5
+
+/* FORMAT_BUFFER_SIZE is how much formatted output is collected before it is
+   written out.  DATUM_CHARS is the most one datum can take: a newline or
+   comma, a sign, ten digits and a decimal point. */
+#define FORMAT_BUFFER_SIZE	8192
+#define DATUM_CHARS		16
+
+/* SHARD_LOCATIONS is the fewest locations worth handing to a thread of
+   their own.  Anything smaller is decoded faster than a thread starts. */
+#define SHARD_LOCATIONS		65536
+
+/* DECODE_BLOCK is how many locations are decoded before they are formatted,
+   so the decoded data never takes more than a small, fixed amount of
+   memory however much arrives at once */
+#define DECODE_BLOCK		4096
+
+enum word_kind {
+	WORD_LOW_RES,
+	WORD_HEADER,
+	WORD_HI_RES_FIRST,
+	WORD_HI_RES_SECOND,
+	WORD_IGNORED,
+	WORD_KINDS
+};
+
+/* The kind of a final storage word depends only on its high byte.
+   WORD_KIND() is the chain of mask tests telling them apart, and word_kind[]
+   holds its result for every high byte so decoding needs one lookup per word
+   instead of a string of hard to predict branches. */
+#define WORD_KIND(b) \
+	(((b) & 0x1c) != 0x1c ? WORD_LOW_RES : \
+	 ((b) & 0xfc) == 0xfc ? WORD_HEADER : \
+	 ((b) & 0x3c) == 0x1c ? WORD_HI_RES_FIRST : \
+	 ((b) & 0xfc) == 0x3c ? WORD_HI_RES_SECOND : WORD_IGNORED)
+#define WORD_KIND4(b)	WORD_KIND(b), WORD_KIND((b) + 1), WORD_KIND((b) + 2), WORD_KIND((b) + 3)
+#define WORD_KIND16(b)	WORD_KIND4(b), WORD_KIND4((b) + 4), WORD_KIND4((b) + 8), WORD_KIND4((b) + 12)
+#define WORD_KIND64(b)	WORD_KIND16(b), WORD_KIND16((b) + 16), WORD_KIND16((b) + 32), WORD_KIND16((b) + 48)
+
+static const uint8_t word_kind[256] = {
+	WORD_KIND64(0), WORD_KIND64(64), WORD_KIND64(128), WORD_KIND64(192)
 };
 
-static void process_output_array_header(FILE *out, uint8_t *buffer)
+/* Each kind of word has a decode routine, which fills in d if the word
+   completes a datum and returns where the next datum goes */
+typedef struct datum *(*decode_t)(decoder_t s, const uint8_t *buffer, struct datum *d);
+
+static struct datum *decode_array_header(decoder_t s, const uint8_t *buffer, struct datum *d)
 {
-	/* Only output leading newline for records after the first */
-	static int t = 0;
+	s->array_id = ((buffer[0] & 0x3) << 8) | buffer[1];
 
-	if(t != 0)
-		fputc('\n', out);
-	else
-		t = 1;
+	d->array_id = s->array_id;
+	d->value = 0;
+	d->decimals = DATUM_HEADER;
 
-	fprintf(out, "%d", ((buffer[0] & 0x3) << 8) | buffer[1]);
+	return d + 1;
 }
 
-static void process_low_res_data(FILE *out, uint8_t *buffer)
+static struct datum *decode_low_res_data(decoder_t s, const uint8_t *buffer, struct datum *d)
 {
-	int sign; 
-	int mantissa = (buffer[0] & 0x60) >> 5;
-	int base;
-	float value;
+	int sign;
 
 	if(buffer[0] & 0x80)
 		sign = -1;
 	else
 		sign = 1;
 
-	base = sign * (((buffer[0] & 0x1f) << 8) | buffer[1]);
-
-	if(mantissa) {
-		switch(mantissa) {
-			case 1:
-				value = base * 0.1;
-				fprintf(out, ",%0.1f", value);
-				break;
-			case 2:
-				value = base * 0.01;
-				fprintf(out, ",%0.2f", value);
-				break;
-			case 3:
-				value = base * 0.001;
-				fprintf(out, ",%0.3f", value);
-				break;
-		}
-	} else
-		fprintf(out, ",%d", base);
+	d->array_id = s->array_id;
+	d->value = sign * (((buffer[0] & 0x1f) << 8) | buffer[1]);
+	d->decimals = (buffer[0] & 0x60) >> 5;
+
+	return d + 1;
 }
 
-static void process_hi_res_first_location(FILE *out, uint8_t *buffer, struct hrv *v)
+static struct datum *decode_hi_res_first_location(decoder_t s, const uint8_t *buffer, struct datum *d)
 {
+	struct hrv *v = &s->v;
+
 	if(buffer[0] & 0x40)
 		v->sign = -1;
 	else
@@ -104,12 +135,14 @@ static void process_hi_res_first_location(FILE *out, uint8_t *buffer, struct hrv
 
 	v->mantissa |= ((buffer[0] & 3) << 1);
 	v->value = buffer[1];
+
+	return d;
 }
 
-static void process_hi_res_second_location(FILE *out, uint8_t *buffer, struct hrv *v)
+static struct datum *decode_hi_res_second_location(decoder_t s, const uint8_t *buffer, struct datum *d)
 {
+	struct hrv *v = &s->v;
 	int base;
-	float value;
 
 	if(buffer[0] & 1)
 		base = 0x10000;
@@ -117,40 +150,297 @@ static void process_hi_res_second_location(FILE *out, uint8_t *buffer, struct hr
 		base = 0;
 
 	base |= (v->value << 8) | buffer[1];
-	base *= v->sign;
-
-	if(v->mantissa) {
-		switch(v->mantissa) {
-			case 1:
-				value = base * 0.1;
-				fprintf(out, ",%0.1f", value);
-				break;
-			case 2:
-				value = base * 0.01;
-				fprintf(out, ",%0.2f", value);
-				break;
-			case 3:
-				value = base * 0.001;
-				fprintf(out, ",%0.3f", value);
-				break;
-			case 4:
-				value = base * 0.0001;
-				fprintf(out, ",%0.4f", value);
-				break;
-			case 5:
-				value = base * 0.00001;
-				fprintf(out, ",%0.5f", value);
+
+	d->array_id = s->array_id;
+	d->value = base * v->sign;
+	d->decimals = v->mantissa;
+
+	return d + 1;
+}
+
+static struct datum *decode_ignored(decoder_t s, const uint8_t *buffer, struct datum *d)
+{
+	return d;
+}
+
+static const decode_t decoders[WORD_KINDS] = {
+	decode_low_res_data,
+	decode_array_header,
+	decode_hi_res_first_location,
+	decode_hi_res_second_location,
+	decode_ignored
+};
+
+/* Decode len bytes of final storage into d, which must have room for one
+   datum per location.  Returns the number of data decoded.
+
+   The locations are scanned a block at a time for anything other than a
+   low-res value, and only those few go through the word kind table. */
+size_t decode_data(decoder_t s, const uint8_t *buffer, size_t len, struct datum *d)
+{
+	struct datum *first = d;
+	uint64_t special;
+	size_t i, k, l, n;
+
+	for(i = 0, l = len / 2; i < l; i += n, buffer += n * 2) {
+		n = l - i < SCAN_BLOCK ? l - i : SCAN_BLOCK;
+		special = scan_block(buffer, n, NULL);
+
+		for(k = 0; k < n; k++, special >>= 1) {
+			if(special & 1)
+				d = decoders[word_kind[buffer[k * 2]]](s, buffer + k * 2, d);
+			else
+				d = decode_low_res_data(s, buffer + k * 2, d);
 		}
+	}
+
+	return d - first;
+}
+
+/* Write value divided by ten to the power of decimals into p, exactly as
+   printf("%0.*f") would print it.  Returns the end of what was written. */
+static char *format_fixed(char *p, int32_t value, int decimals)
+{
+	char digits[12];
+	uint32_t u;
+	int n = 0;
+
+	if(value < 0) {
+		*p++ = '-';
+		u = -(uint32_t)value;
+	} else
+		u = value;
+
+	/* Least significant first, with enough zeros for a digit before the
+	   decimal point */
+	do {
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while(u != 0 || n <= decimals);
+
+	while(n > decimals)
+		*p++ = digits[--n];
+
+	if(decimals > 0) {
+		*p++ = '.';
+
+		while(n > 0)
+			*p++ = digits[--n];
+	}
+
+	return p;
+}
+
+/* Write decoded data out, one line per output array */
+void format_data(decoder_t dec, const struct datum *d, size_t n)
+{
+	char buf[FORMAT_BUFFER_SIZE], *p = buf;
+
+	for(; n > 0; n--, d++) {
+		if(p > buf + sizeof(buf) - DATUM_CHARS) {
+			fwrite(buf, 1, p - buf, dec->out);
+			p = buf;
+		}
+
+		if(d->decimals == DATUM_HEADER) {
+			/* Only output leading newline for records after the first */
+			if(dec->started != 0)
+				*p++ = '\n';
+			else
+				dec->started = 1;
+
+			p = format_fixed(p, d->array_id, 0);
+		} else if(d->decimals <= MAX_DECIMALS) {
+			*p++ = ',';
+			p = format_fixed(p, d->value, d->decimals);
+		}
+	}
+
+	fwrite(buf, 1, p - buf, dec->out);
+}
+
+/* Decode whole locations and write them out, a block at a time */
+static void decode_sequential(decoder_t dec, const uint8_t *buffer, size_t len)
+{
+	struct datum *d;
+	size_t n;
+
+	d = (struct datum *)xmalloc(DECODE_BLOCK * sizeof(struct datum));
+
+	for(; len > 0; len -= n, buffer += n) {
+		n = len < DECODE_BLOCK * 2 ? len : DECODE_BLOCK * 2;
+		format_data(dec, d, decode_data(dec, buffer, n, d));
+	}
 
+	xfree(d);
+}
+
+/* A run of locations decoded and formatted by a thread of its own */
+struct shard {
+	const uint8_t *buffer;
+	size_t len;
+	struct decoder dec;	/* State at the start, then at the end */
+	char *text;		/* Formatted output, or NULL to decode it later */
+	size_t size;
+	pthread_t thread;
+	int running;
+};
+
+/* Format a shard into memory.  If that fails it is left in its starting
+   state to be decoded again straight to the output. */
+static void *decode_shard(void *arg)
+{
+	struct shard *sh = (struct shard *)arg;
+	struct decoder start = sh->dec;
+
+	if((sh->dec.out = open_memstream(&sh->text, &sh->size)) == NULL) {
+		sh->dec = start;
+		return NULL;
+	}
+
+	decode_sequential(&sh->dec, sh->buffer, sh->len);
+
+	if(fclose(sh->dec.out) != 0) {
+		free(sh->text);
+		sh->text = NULL;
+		sh->dec = start;
 	} else
-		fprintf(out, ",%d", base);
+		sh->dec.out = start.out;
+
+	return NULL;
+}
+
+/* Work out what a shard starts with from the one before it: the last hi-res
+   first half seen, and whether an array has been started */
+static void seed_shard(struct shard *sh, const struct shard *prev)
+{
+	const uint8_t *w;
+
+	sh->dec = prev->dec;
+	sh->dec.started = prev->dec.started || scan_next_header(prev->buffer, 0, prev->len / 2) < prev->len / 2;
+
+	for(w = prev->buffer + prev->len - 2; w >= prev->buffer; w -= 2)
+		if(word_kind[w[0]] == WORD_HI_RES_FIRST) {
+			decode_hi_res_first_location(&sh->dec, w, NULL);
+			break;
+		}
 }
 
-void process_data(FILE *out, uint8_t *buffer, size_t len)
+/* Decode on up to dec->threads threads.  The data is split into shards at
+   array headers, so each one starts in a known state, and the shards are
+   written out in order.  The output is exactly what decoding it in one go
+   gives. */
+static void decode_parallel(decoder_t dec, const uint8_t *buffer, size_t len)
 {
-	int i, l;
-	uint8_t b;
-	static struct hrv v;
+	struct shard *sh;
+	size_t l = len / 2, from, at, i, n = 0, threads = dec->threads;
+
+	if(threads > l / SHARD_LOCATIONS)
+		threads = l / SHARD_LOCATIONS;
+
+	sh = (struct shard *)xmalloc(threads * sizeof(struct shard));
+
+	for(i = 0, from = 0; i < threads && from < l; i++, from = at) {
+		at = i == threads - 1 ? l : scan_next_header(buffer, l / threads * (i + 1), l);
+
+		if(at <= from)
+			continue;
+
+		sh[n].buffer = buffer + from * 2;
+		sh[n].len = (at - from) * 2;
+		sh[n].text = NULL;
+
+		if(n == 0)
+			sh[n].dec = *dec;
+		else
+			seed_shard(&sh[n], &sh[n - 1]);
+
+		n++;
+	}
+
+	for(i = 0; i < n; i++)
+		sh[i].running = pthread_create(&sh[i].thread, NULL, decode_shard, &sh[i]) == 0;
+
+	for(i = 0; i < n; i++) {
+		if(sh[i].running)
+			pthread_join(sh[i].thread, NULL);
+		else
+			decode_shard(&sh[i]);
+
+		if(sh[i].text != NULL) {
+			fwrite(sh[i].text, 1, sh[i].size, dec->out);
+			free(sh[i].text);
+		} else {
+			sh[i].dec.started = i == 0 ? dec->started : sh[i - 1].dec.started;
+			decode_sequential(&sh[i].dec, sh[i].buffer, sh[i].len);
+		}
+	}
+
+	dec->array_id = sh[n - 1].dec.array_id;
+	dec->v = sh[n - 1].dec.v;
+	dec->started = sh[n - 1].dec.started;
+
+	xfree(sh);
+}
+
+decoder_t decoder_create(FILE *out, int threads)
+{
+	decoder_t dec = ALLOC(decoder);
+
+	dec->out = out;
+	dec->threads = threads;
+	dec->array_id = 0;
+	dec->v.sign = 0;
+	dec->v.mantissa = 0;
+	dec->v.value = 0;
+	dec->started = 0;
+	dec->partial = -1;
+
+	return dec;
+}
+
+/* Decode and write out the next len bytes of final storage.  The data may
+   be cut anywhere, even in the middle of a location or a hi-res value. */
+void decoder_feed(decoder_t dec, const uint8_t *buffer, size_t len)
+{
+	uint8_t word[2];
+
+	if(len == 0)
+		return;
+
+	if(dec->partial >= 0) {
+		word[0] = dec->partial;
+		word[1] = buffer[0];
+		dec->partial = -1;
+
+		decode_sequential(dec, word, 2);
+
+		buffer++;
+		len--;
+	}
+
+	if(len % 2 != 0)
+		dec->partial = buffer[--len];
+
+	if(dec->threads > 1 && len / 2 >= 2 * SHARD_LOCATIONS)
+		decode_parallel(dec, buffer, len);
+	else
+		decode_sequential(dec, buffer, len);
+}
+
+/* End the output and free the decoder.  Half a location left over at the
+   end is dropped. */
+void decoder_finish(decoder_t dec)
+{
+	// DHX Append a trailing newline at the EOF
+	fputc('\n', dec->out);
+
+	xfree(dec);
+}
+
+void process_data(FILE *out, uint8_t *buffer, size_t len, int threads)
+{
+	decoder_t dec;
 	/*
 	char *rawfile = NULL;
 	FILE *rfile = NULL;
@@ -165,21 +455,7 @@ void process_data(FILE *out, uint8_t *buffer, size_t len)
 		}
 	}*/
 
-	for(i = 0, l = len / 2; i < l; i++) {
-		b = buffer[i * 2];
-
-		if((b & 0x1c) == 0x1c) {
-			if((b & 0xfc) == 0xfc)
-				process_output_array_header(out, buffer + i * 2);
-			else if((b & 0x3c) == 0x1c)
-				process_hi_res_first_location(out, buffer + i * 2, &v);
-			else if((b & 0xfc) == 0x3c)
-				process_hi_res_second_location(out, buffer + i * 2, &v);
-		} else
-			process_low_res_data(out, buffer + i * 2);
-	}
-
-	// DHX Append a trailing newline at the EOF
-	fputc('\n', out);
-
+	dec = decoder_create(out, threads);
+	decoder_feed(dec, buffer, len);
+	decoder_finish(dec);
 }
@@ -34,6 +34,45 @@
 #ifndef FORMAT_DATA_H
 #define FORMAT_DATA_H
 
-void process_data(FILE *out, uint8_t *buffer, size_t len);
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+/* Marks a datum that starts a new output array rather than holding a value */
+#define DATUM_HEADER	-1
+
+/* One decoded final storage value */
+struct datum {
+	int array_id;	/* Output array the value belongs to */
+	int32_t value;	/* The value times ten to the power of decimals */
+	int decimals;	/* Digits after the decimal point, or DATUM_HEADER */
+};
+
+/* The first half of a hi-res value, kept until the second arrives */
+struct hrv {
+	int sign;
+	int mantissa;
+	uint8_t value;
+};
+
+/* Turns final storage data into text as it arrives.  Everything carried
+   from one piece of data to the next lives here, so any number of decoders
+   can be used at once, on any thread. */
+typedef struct decoder {
+	FILE *out;
+	int threads;	/* Threads to decode large pieces of data with */
+	int array_id;	/* Output array being decoded */
+	struct hrv v;
+	int started;	/* Set once the first array has been output */
+	int partial;	/* First byte of a location cut in two, or -1 */
+} *decoder_t;
+
+decoder_t decoder_create(FILE *out, int threads);
+void decoder_feed(decoder_t dec, const uint8_t *buffer, size_t len);
+void decoder_finish(decoder_t dec);
+
+size_t decode_data(decoder_t dec, const uint8_t *buffer, size_t len, struct datum *d);
+void format_data(decoder_t dec, const struct datum *d, size_t n);
+void process_data(FILE *out, uint8_t *buffer, size_t len, int threads);
 
 #endif
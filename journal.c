@@ -0,0 +1,228 @@
+/*
+   journal.c - Crash-safe spool of downloaded data
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "journal.h"
+#include "output.h"
+#include "xmalloc.h"
+
+/* The journal starts with a text line naming the download it belongs to:
+
+     crget-journal 1 <key> <filled locations> <start location> <order>
+
+   where order is "oldest" or "newest" for a download fetching the oldest or
+   the newest data first, as the records fill the download from opposite
+   ends.  The header is followed by one binary record per verified chunk: a
+   journal_record and 2 * count bytes of data.  Records are only ever
+   appended, and each is synced before the next chunk is requested.  A crash
+   can at worst leave a torn record at the end, which the check value
+   exposes. */
+#define JOURNAL_VERSION		1
+#define JOURNAL_HEADER_SIZE	512
+#define JOURNAL_MAGIC		0x4a524743	/* "CGRJ" */
+
+struct journal_record {
+	uint32_t magic;
+	int32_t offset;		/* Locations into the download */
+	int32_t location;	/* Where the chunk was read from */
+	int32_t count;		/* Locations in the chunk */
+	uint32_t check;		/* FNV-1a over the fields above and the data */
+};
+
+static uint32_t journal_hash(uint32_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+static uint32_t journal_check(const struct journal_record *r, const uint8_t *data)
+{
+	uint32_t h = 2166136261U;
+
+	h = journal_hash(h, &r->offset, sizeof(r->offset));
+	h = journal_hash(h, &r->location, sizeof(r->location));
+	h = journal_hash(h, &r->count, sizeof(r->count));
+
+	return journal_hash(h, data, 2 * r->count);
+}
+
+/* Read the records that continue the download without a gap into buffer.
+   A download fetching the newest data first grows back from the end instead
+   of forward from the start.  Returns the file offset just past the last good
+   record. */
+static off_t journal_replay(int fd, off_t pos, uint8_t *buffer, int total, int newest_first, int *downloaded)
+{
+	struct journal_record r;
+	int next;
+
+	while(pread(fd, &r, sizeof(r), pos) == sizeof(r)) {
+		if(r.magic != JOURNAL_MAGIC || r.count <= 0 || r.offset < 0 || r.offset + r.count > total)
+			break;
+
+		next = newest_first ? total - *downloaded - r.count : *downloaded;
+
+		if(r.offset != next)
+			break;
+
+		if(pread(fd, buffer + 2 * r.offset, 2 * r.count, pos + sizeof(r)) != 2 * r.count)
+			break;
+
+		if(journal_check(&r, buffer + 2 * r.offset) != r.check)
+			break;
+
+		*downloaded += r.count;
+		pos += sizeof(r) + 2 * r.count;
+	}
+
+	return pos;
+}
+
+static ssize_t journal_header(char *header, const char *key, int filled, int start, int newest_first)
+{
+	return snprintf(header, JOURNAL_HEADER_SIZE, "crget-journal %d %s %d %d %s\n", JOURNAL_VERSION,
+			key, filled, start, newest_first ? "newest" : "oldest");
+}
+
+/* Open the journal for a download, recovering whatever an earlier attempt
+   at the same download left behind.  Recovered data is put in buffer, which
+   must hold total locations, and *downloaded is set to how many there are.
+   A journal for a different download, or for the same one fetched in the
+   other order, is started over. */
+journal_t journal_open(const char *path, const char *key, int filled, int start, uint8_t *buffer, int total, int newest_first, int *downloaded)
+{
+	char header[JOURNAL_HEADER_SIZE], other[JOURNAL_HEADER_SIZE], old[JOURNAL_HEADER_SIZE];
+	ssize_t len, n;
+	off_t end;
+	journal_t j;
+	int fd;
+
+	*downloaded = 0;
+
+	if((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	len = journal_header(header, key, filled, start, newest_first);
+
+	if((n = pread(fd, old, len, 0)) == len && !memcmp(header, old, len)) {
+		end = journal_replay(fd, len, buffer, total, newest_first, downloaded);
+
+		if(*downloaded > 0)
+			print("Resuming from journal: %d locations already downloaded\n", *downloaded);
+	} else {
+		if(n == len && journal_header(other, key, filled, start, !newest_first) == len && !memcmp(other, old, len))
+			print("Warning: Discarding journal '%s' fetched %s first\n", path, newest_first ? "oldest" : "newest");
+		else if(n > 0)
+			print("Warning: Discarding journal '%s' from a different download\n", path);
+
+		if(ftruncate(fd, 0) < 0 || pwrite(fd, header, len, 0) != len || fdatasync(fd) < 0) {
+			print("Warning: Couldn't write journal '%s'\n", path);
+			close(fd);
+			return NULL;
+		}
+
+		end = len;
+	}
+
+	/* Drop anything after the last usable record before appending */
+	if(ftruncate(fd, end) < 0 || lseek(fd, end, SEEK_SET) < 0) {
+		print("Warning: Couldn't write journal '%s'\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	j = ALLOC(journal);
+	j->fd = fd;
+	j->path = xstrdup(path);
+
+	return j;
+}
+
+/* Add a verified chunk and make sure it reached the disk */
+int journal_append(journal_t j, int offset, int location, const uint8_t *data, int count)
+{
+	struct journal_record r;
+	struct iovec iov[2];
+
+	r.magic = JOURNAL_MAGIC;
+	r.offset = offset;
+	r.location = location;
+	r.count = count;
+	r.check = journal_check(&r, data);
+
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = 2 * count;
+
+	if(writev(j->fd, iov, 2) != (ssize_t)(sizeof(r) + 2 * count) || fdatasync(j->fd) < 0) {
+		print("Warning: Couldn't append to journal '%s'\n", j->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+void journal_close(journal_t j)
+{
+	if(j != NULL) {
+		close(j->fd);
+		xfree(j->path);
+		xfree(j);
+	}
+}
+
+/* The download has been processed, so the journal is no longer needed */
+void journal_remove(journal_t j)
+{
+	if(j != NULL) {
+		unlink(j->path);
+		journal_close(j);
+	}
+}
@@ -32,29 +32,36 @@
  */
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <inttypes.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
 
 #include "logger.h"
+#include "deadline.h"
+#include "response.h"
 #include "fd.h"
 #include "xmalloc.h"
 #include "output.h"
 
-/* RESPONSE_TIMEOUT specifies (in seconds) how long to wait for a response
- * from the datalogger for any given command.  If it doesn't respond in
- * the specified number of seconds, it is considered a fatal error. */
-#define RESPONSE_TIMEOUT        40
+/* RESPONSE_TIMEOUT specifies (in milliseconds) how long a single command,
+ * including its complete response, may take.  If the datalogger hasn't
+ * finished responding by then, it is considered a fatal error.  It can be
+ * overridden with the RESPONSE_TIMEOUT environment variable. */
+#define RESPONSE_TIMEOUT        40000
 
 /* INIT_RETRIES specifies the number of times to send CRLF to the datalogger
  * to get the initial prompt.  After we have the initial prompt all operations
  * are synchronous and shouldn't be prone to weird timing errors. */
 #define INIT_RETRIES            10
 
+/* INIT_INTERVAL specifies (in milliseconds) how long to wait for a prompt
+ * after each of those CRLFs. */
+#define INIT_INTERVAL           125
+
 /* PROMPT_ATTEMPTS specifies how many times we will loop back trying to
  * get a prompt.  We shouldn't have to do this much as we will know rather
  * quickly if we fail.  IMPORTANT: This should divide evenly into
@@ -71,6 +78,11 @@
  * response to an issued command. */
 #define RESPONSE_LINES          14
 
+/* COMMAND_ATTEMPTS specifies how many times a command is sent before we give
+ * up, when the datalogger keeps answering with something other than the
+ * command's echo. */
+#define COMMAND_ATTEMPTS        3
+
 /* CLOCK_THRESHOLD defines how many seconds the clock may be off without 
  * updating it. */
 #define CLOCK_THRESHOLD         30
@@ -78,39 +90,101 @@
 /* STANDARD_DATA_CHUNK_SIZE defines how many locations we will read at a
  * given time.  The bigger this is the faster reading data will go.
  * Author's note: I ended up calling on this.  They recommended reading
- * data in 2048 byte (1024 location) chunks. */
+ * data in 2048 byte (1024 location) chunks.  This is now only the starting
+ * point; the size adapts to the link unless DATA_CHUNK_SIZE is set in the
+ * environment. */
 #define STANDARD_DATA_CHUNK_SIZE        1024
 
+/* MIN_DATA_CHUNK_SIZE and MAX_DATA_CHUNK_SIZE bound the adaptive chunk size.
+ * The maximum stays at the recommended 1024 locations, as nothing larger
+ * has been verified against a real logger; on fast links the chunk only
+ * shrinks after failures and grows back to it. */
+#define MIN_DATA_CHUNK_SIZE             128
+#define MAX_DATA_CHUNK_SIZE             STANDARD_DATA_CHUNK_SIZE
+
+/* DATA_CHUNK_INCREMENT is how many locations are added to the chunk size
+ * after a clean read, as long as the round trip still dominates.  The chunk
+ * keeps growing while CHUNK_OVERHEAD_RATIO round trips take longer than the
+ * read itself, i.e. while the command overhead is above roughly 1/8. */
+#define DATA_CHUNK_INCREMENT            256
+#define CHUNK_OVERHEAD_RATIO            8
+
+/* CHUNK_CLEAN_READS is how many clean full-sized reads in a row grow a
+ * chunk that failures shrank back towards STANDARD_DATA_CHUNK_SIZE, however
+ * small the round trip.  On a slow but quiet line, e.g. direct serial at
+ * 9600 baud, the round trip never dominates and the chunk would otherwise
+ * stay small after a few errors. */
+#define CHUNK_CLEAN_READS               4
+
 /* EXCEPTION_DATA_CHUNK_SIZE defines how many locations we will read at
  * a given time in the event that a checksum fails.  For fastest results, 
  * this should be a multiple of STANDARD_DATA_CHUNK_SIZE */
 #define EXCEPTION_DATA_CHUNK_SIZE       64
 
+/* RECOVERY_PIECES is how many pieces a range that failed its checksum is
+ * read again in, at most.  See logger_recover_data(). */
+#define RECOVERY_PIECES                 4
+
 /* MAX_CHECKSUM_FAILURES defines, while in exception mode, how many times
- * a checksum can fail before we give up. */
+ * a checksum can fail before we give up.  EXCEPTION_DATA_CHUNK_SIZE is also
+ * the smallest piece a range that failed its checksum is read again in. */
 #define MAX_CHECKSUM_FAILURES           5
 
-/* Initialize the datalogger and return a new logger object */
-logger_t logger_create(fd_t s)
+/* Initialize the datalogger and return a new logger object.  Neither this
+   nor any later exchange waits past the deadline (0 for none). */
+logger_t logger_create(fd_t s, deadline_t deadline)
 {
 	int r = 0;
 	logger_t l = ALLOC(logger);
 
 	l->p = s;
+	l->state = LOGGER_UNKNOWN;
 	l->security_level = 0;
+	l->timeout = RESPONSE_TIMEOUT;
+	l->deadline = deadline;
+	l->pipeline = 0;
+	l->round_trips = 0;
+	l->filled = -1;
+	l->mptr = -1;
+	l->back_from = l->back_to = -1;
+
+	if(getenv("RESPONSE_TIMEOUT") != NULL && atoi(getenv("RESPONSE_TIMEOUT")) > 0)
+		l->timeout = atoi(getenv("RESPONSE_TIMEOUT"));
+
+	if(getenv("PIPELINE_DOWNLOAD") != NULL && atoi(getenv("PIPELINE_DOWNLOAD")) > 0)
+		l->pipeline = 1;
+
+	memset(&l->chunk, 0, sizeof(l->chunk));
+	l->chunk.size = STANDARD_DATA_CHUNK_SIZE;
+	l->chunk.rtt = -1;
+
+	if(getenv("DATA_CHUNK_SIZE") != NULL && atoi(getenv("DATA_CHUNK_SIZE")) > 0) {
+		l->chunk.size = atoi(getenv("DATA_CHUNK_SIZE"));
+		l->chunk.fixed = 1;
+
+		if(l->chunk.size > MAX_DATA_CHUNK_SIZE)
+			l->chunk.size = MAX_DATA_CHUNK_SIZE;
+	}
+
+	l->chunk.smallest = l->chunk.largest = l->chunk.size;
 
 	fd_flush(l->p); 
 
+	/* Once the prompt shows up it is consumed, so the first command can
+	   go out without asking for another one */
 	do {
 		if(fd_write(l->p, "\r\n", 2) < 0) {
 			print("Serial error: Couldn't send to device!\n");
 			return NULL;
 		}
 
-		usleep(125000L);
-	} while(fd_buffer_count(l->p) == 0 && r++ < INIT_RETRIES);
+		l->round_trips++;
 
-	if(r == INIT_RETRIES) {
+		if(fd_scan(l->p, '*', PROMPT_CHARACTERS, deadline_within(INIT_INTERVAL, deadline)) > 0)
+			l->state = LOGGER_PROMPT;
+	} while(l->state != LOGGER_PROMPT && ++r < INIT_RETRIES && (deadline == 0 || !deadline_expired(deadline)));
+
+	if(l->state != LOGGER_PROMPT) {
 		print("Datalogger error: No response from datalogger!\n");
 		return NULL;
 	}
@@ -127,11 +201,18 @@ void logger_destroy(logger_t l)
 	}
 }
 
-/* Get an asterisk prompt from the datalogger */
+/* Get an asterisk prompt from the datalogger.  Nothing is sent if the prompt
+   that ended the previous response has already been consumed. */
 static int logger_get_prompt(logger_t l)
 {
 	int i, a = 0;
 	char c;
+	deadline_t deadline, attempt;
+
+	if(l->state == LOGGER_PROMPT)
+		return 0;
+
+	l->state = LOGGER_UNKNOWN;
 
 	if(fd_buffer_count(l->p) != 0) 
 		fd_flush(l->p);
@@ -141,10 +222,14 @@ static int logger_get_prompt(logger_t l)
 		return -1;
 	}
 
+	l->round_trips++;
+	deadline = deadline_within(l->timeout, l->deadline);
+	attempt = deadline_min(deadline, deadline_after(l->timeout / PROMPT_ATTEMPTS));
+
 	for(i = 0; i < PROMPT_CHARACTERS; i++) {
-		while(fd_read_raw(l->p, &c, 1, RESPONSE_TIMEOUT / PROMPT_ATTEMPTS) < 0)
+		while(fd_read_raw(l->p, &c, 1, attempt) < 0)
 		{
-			if(a > PROMPT_ATTEMPTS) {
+			if(a > PROMPT_ATTEMPTS || deadline_expired(deadline)) {
 				print("Serial error: Couldn't read data from buffer while getting prompt! (Possible timeout)\n");
 				return -1;
 			}
@@ -154,13 +239,17 @@ static int logger_get_prompt(logger_t l)
 				return -1;
 			}
 
+			l->round_trips++;
+			attempt = deadline_min(deadline, deadline_after(l->timeout / PROMPT_ATTEMPTS));
 			a++;
 		}
 		// DHX - I have an error here because we try to get the prompt multiple times and we get it multiple times
 		// back while we only wait for the first response. This produces an error later on in the logger_command function
 		// when we expect to get back from the logger the same command we have sent - instead getting the prompt.
-		if(c == '*') 
+		if(c == '*') {
+			l->state = LOGGER_PROMPT;
 			return 0;
+		}
 	}
 
 	print("Datalogger error: No response while trying to get prompt!\n");
@@ -168,90 +257,78 @@ static int logger_get_prompt(logger_t l)
 	return -1;
 }
 
-/* Send a command to the datalogger 
-
-   XXX This whole function really needs to be rewritten.  One way to start is to
-   remove the get prompt function, and have this function get a prompt before
-   it returns, then set a value in logger saying the datalogger is ready for the 
-   next command. */
-static ssize_t logger_command(logger_t l, char *instr, char *outstr, int len)
+/* Consume the prompt the datalogger prints after a complete response, so the
+   next command can follow without another CRLF round trip.  Failing to find
+   it is not an error in itself; the next command will simply resynchronise. */
+static void logger_expect_prompt(logger_t l, deadline_t deadline)
 {
-	int i, ec = 0;
-	char *outptr;
-
-	memset(outstr, '\0', len);
-
-	if(fd_flush(l->p) < 0) {
-		print("Serial error: Unable to flush buffer while sending command!\n");
-		return -1;
-	}
-
-	if(fd_write(l->p, instr, strlen(instr)) < 0) {
-		print("Serial error: Couldn't write to device while sending command!\n");
-		return -1;
-	}
-
-	if(fd_write(l->p, "\r\n", 2) < 0) {
-		print("Serial error: Couldn't write to device while sending command!\n");
-		return -1;
-	}
+	if(fd_scan(l->p, '*', PROMPT_CHARACTERS, deadline) > 0)
+		l->state = LOGGER_PROMPT;
+	else
+		l->state = LOGGER_UNKNOWN;
+}
 
-	for(i = 0; i < RESPONSE_LINES; i++) {
-		if(fd_read_line(l->p, outstr, len, RESPONSE_TIMEOUT) < 0) {
-			print("Serial error: Couldn't read from device while sending command!\n");
+/* Send a command to the datalogger and parse its reply into r.  The prompt
+   following the reply is consumed before returning, leaving the logger
+   ready for the next command.
+
+   XXX Okay, here's how this goes.  I was running into a bug where I would
+   get a command back from the datalogger that wasn't the original one I
+   issued.  Basically, we wait for the command we issued to be echoed back
+   to us.  If we get something else in the mean time, we resynchronise,
+   send the command again and hope for the best.  If echo_optional is set a
+   reply that arrives without the echo is accepted as well. */
+static int logger_request(logger_t l, const char *instr, const char *terminator, int echo_optional, struct response *r)
+{
+	int attempt;
+	ssize_t len;
+	void *data;
+	struct iovec iov[2];
+	deadline_t deadline;
+
+	for(attempt = 0; attempt < COMMAND_ATTEMPTS; attempt++) {
+		if(attempt > 0 && logger_get_prompt(l) < 0)
 			return -1;
-		}
 
-		// DHX what do we do here.... we have received something from the logger and now
-		// have a look at it.... for debugging we output what we get here
-		//
-		//	printf("REC: %s \n",outstr);
-
-		if((outptr = strrchr(outstr, '*')) == NULL) {
-			outptr = outstr;
-			//print("--**--\n");
-		} else {
-			outptr++;
-			//printf("TR: %s \n",outptr);
+		if(fd_flush(l->p) < 0) {
+			print("Serial error: Unable to flush buffer while sending command!\n");
+			return -1;
 		}
 
+		iov[0].iov_base = (char *)instr;
+		iov[0].iov_len = strlen(instr);
+		iov[1].iov_base = (char *)terminator;
+		iov[1].iov_len = strlen(terminator);
 
-		if(strlen(outptr) == 0)
-			continue;
+		l->state = LOGGER_PENDING;
 
-		//DHX i've commented this out as it does not make sense.
-		//if(c == len)
-		//	continue;
-
-		if(strlen(outptr) == 0)
-			continue;
+		if(fd_writev(l->p, iov, 2) < 0) {
+			print("Serial error: Couldn't write to device while sending command!\n");
+			return -1;
+		}
 
-		/* XXX Okay, here's how this goes.  I was running into a 
-		   bug where I would get a command back from the
-		   datalogger that wasn't the original one I issued.
-		   This is a cheap hack to correct this problem.
+		l->round_trips++;
+		deadline = deadline_within(l->timeout, l->deadline);
+		response_init(r, instr);
+		r->echo_optional = echo_optional;
 
-		   Basically, we wait for the command we issued to be echoed
-		   back to us.  If we get something else in the mean time, 
-		   the bug has been encountered, so we just reinitialize, retry,
-		   and hope for the best.
-		 */
+		/* The reply is parsed straight out of the receive buffer */
+		while(!r->done && !r->error && r->lines < RESPONSE_LINES) {
+			if((len = fd_peek(l->p, &data, deadline)) < 0) {
+				print("Serial error: Couldn't read from device while sending command!\n");
+				return -1;
+			}
 
-		if(!strcmp(instr, outptr)) {
-			ec = 1;
-			continue;
+			fd_consume(l->p, response_feed(r, data, len));
 		}
 
-		if(ec) 
-			return strlen(outstr);
-
-		/* At this point we've encountered the bug. */
-
-		if(logger_get_prompt(l) < 0) {
-			return -1;
+		if(r->done) {
+			logger_expect_prompt(l, deadline);
+			return 0;
 		}
 
-		return logger_command(l, instr, outstr, len);
+		if(!r->error)
+			break;
 	}
 
 	print("Datalogger error: Invalid response received while sending command\n");
@@ -259,6 +336,11 @@ static ssize_t logger_command(logger_t l, char *instr, char *outstr, int len)
 	return -1;
 }
 
+static int logger_command(logger_t l, const char *instr, struct response *r)
+{
+	return logger_request(l, instr, "\r\n", 0, r);
+}
+
 /*
    Each time we set the security level we also verify the checksum
    The first operation should be to set the security level, in order that
@@ -273,86 +355,45 @@ static ssize_t logger_command(logger_t l, char *instr, char *outstr, int len)
  */
 int logger_set_security_level(logger_t l, char *password)
 {
-	int i = 0, j = 0, smark = 0, lmark = 0, cmark = 0, tc = 0;
-	char *cmd, sl_buf[4], cs_buf[6], c;
-	uint16_t checksum = 0;
-	int16_t cf = -1;
+	char *cmd;
+	struct response r;
+	struct response_security sec;
+	int ret;
 
 	if(logger_get_prompt(l) < 0)
 		return -1;
 
-	cmd = (char *)xmalloc(strlen(password) + 4);
+	cmd = (char *)xmalloc(strlen(password) + 2);
+	sprintf(cmd, "%sL", password);
 
-	strcpy(cmd, password);
-	strcat(cmd, "L\r\n\n");
+	/* The reply is checked by its own checksum, so as in the original
+	   parser it doesn't have to follow the echo */
+	ret = logger_request(l, cmd, "\r\n\n", 1, &r);
+	xfree(cmd);
 
-	if(fd_write(l->p, cmd, strlen(cmd)) < 0) {
-		xfree(cmd);
-		print("Lost communication with datalogger (Serial write failed)\n");
+	if(ret < 0) {
+		print("Lost communication with datalogger (Didn't receive prompt)\n");
 		return -1;
 	}
 
-	xfree(cmd);
-
-	do {
-		if(tc++ > PROMPT_CHARACTERS) {
-			print("Lost communication with datalogger (Didn't receive prompt)\n");
-			return -1;
-		}
-
-		fd_read_raw(l->p, &c, 1, RESPONSE_TIMEOUT);
-		if(!cmark && c != '*') 
-			checksum = (checksum + c) % 8192;
-
-		if(cmark == 1 && j < 6)
-			cs_buf[j++] = c;
-		else if(smark == 1 && i < 4)
-			sl_buf[i++] = c;
-
-		if(!isdigit(c)) {
-			if(cmark == 1) {
-				cmark = 0;
-				cs_buf[j < 6 ? j : 5] = '\0';
-			} else if(smark == 1) {
-				smark = 0;
-				sl_buf[i < 4 ? i : 3] = '\0';
-			}
-		}
-
-		if(lmark == 1) {
-			if(c == 'C' && cmark == 0) {
-				cf = checksum;
-				cmark = 1;
-			} else if(c == 'S' && smark == 0) 
-				smark = 1;
-		} else if(c == '\n')
-			lmark = 1;
-	} while(!lmark || c != '*');
-
-	if(!j || cf == -1) {
+	if(response_security(&r, &sec) < 0) {
 		print("Lost communication with datalogger (No checksum issued)\n");
 		return -1;
-	} else {
-		if(cmark == 1)
-			cs_buf[j < 6 ? j : 5] = '\0';
+	}
 
-		if(atoi(cs_buf) != cf) {
-			print("Error communicating with datalogger (Checksum mismatch)\n");
-			return -1;
-		}
+	if(!sec.valid) {
+		print("Error communicating with datalogger (Checksum mismatch)\n");
+		return -1;
 	}
 
-	if(!i) {
-		print("Warning: Failed to set security level (Invalid passcode or datalogger unlocked)\n", password);
+	if(sec.level < 0) {
+		print("Warning: Failed to set security level (Invalid passcode or datalogger unlocked)\n");
 		return 1;
-	} else {
-		if(smark == 1)
-			sl_buf[i < 4 ? i : 3] = '\0';
-
-		l->security_level = atoi(sl_buf);
-		print("Security level set to %d\n", l->security_level);
 	}
 
+	l->security_level = sec.level;
+	print("Security level set to %d\n", l->security_level);
+
 	return 0;
 }
 
@@ -406,20 +447,21 @@ they are counted from one.
 int logger_update_clock(logger_t l, int *skew)
 {
 	time_t t, tb, ta, tl;
-	int i = 0;
-	int logger_day = 0, logger_hour = 0, logger_minute = 0, logger_second = 0;
+	int logger_day, logger_hour, logger_minute, logger_second;
 	int real_day, real_hour, real_minute, real_second;
 	int real_ysec, logger_ysec;
 	int real_skew;
 	int lag = 0;
 
-	char outbuf[128], inbuf[128], *bptr, *dptr, *tptr = NULL;
+	char outbuf[128];
+	struct response r;
+	struct response_clock clk;
 
 	if(logger_get_prompt(l) < 0)
 		return -1;
 
 	tb = time(NULL);
-	if(logger_command(l, "C", inbuf, 128) < 0)
+	if(logger_command(l, "C", &r) < 0)
 		return -1;
 	ta = time(NULL);
     // calculate the lag the command did take to execute to
@@ -427,35 +469,15 @@ int logger_update_clock(logger_t l, int *skew)
 	lag = (int)(((double)(ta-tb))/2);
 	t = ta + lag;
 
-	bptr = inbuf;
-	while((dptr = strsep(&bptr, " ")) != NULL) {
-		switch(dptr[0]) {
-			case 'D':
-				logger_day = atoi(dptr + 1);
-				break;
-			case 'T':
-				tptr = dptr + 1;
-				break;
-		}
+	if(response_clock(&r, &clk) < 0) {
+		print("Error: Invalid clock response from datalogger\n");
+		return -1;
 	}
 
-	if(tptr != NULL) {
-		while((dptr = strsep(&tptr, ":")) != NULL) {
-			switch(i) {
-				case 0:
-					logger_hour = atoi(dptr);
-					break;
-				case 1:
-					logger_minute = atoi(dptr);
-					break;
-				case 2:
-					logger_second = atoi(dptr);
-					break;
-			}
-
-			i++;
-		}
-	}
+	logger_day = clk.day;
+	logger_hour = clk.hour;
+	logger_minute = clk.minute;
+	logger_second = clk.second;
 
 	logger_ysec = (logger_day - 1) * 86400 + logger_hour * 3600 + logger_minute * 60 + logger_second;
 
@@ -486,7 +508,7 @@ int logger_update_clock(logger_t l, int *skew)
 
 		snprintf(outbuf, 128, "%03d:%02d:%02d:%02dC", real_day + 1, real_hour, real_minute, real_second);
 
-		if(logger_command(l, outbuf, inbuf, 128) < 0)
+		if(logger_command(l, outbuf, &r) < 0)
 			return 1;
 		} else {
 			print("Not updating clock: The lag of the connection is too high (%d > 1 sec).\n", lag);
@@ -501,104 +523,95 @@ int logger_update_clock(logger_t l, int *skew)
 	return 0;
 }
 
-/* Returns the current location along with how many records have been filled */
+/* Returns the current location along with how many records have been filled.
+   The array length is only determined if locations_per_array isn't NULL. */
 int logger_get_position(logger_t l, int *reference_location, int *filled_locations, int *memory_pointer, int *locations_per_array)
 {
-	char status_line[128], loc_status_line[128];
-	char *s = status_line, *ls = loc_status_line, *p, *t;
+	struct response r;
+	struct response_position pos;
 
 	if(logger_get_prompt(l) < 0)
 		return -1;
 
-	if(logger_command(l, "A", s, 128) < 0)
+	if(logger_command(l, "A", &r) < 0)
 		return -1;
 
+	response_position(&r, &pos);
+
+	l->mptr = pos.pointer;
+	l->filled = pos.filled;
+
 	if(reference_location != NULL)
-		*reference_location = -1;
+		*reference_location = pos.reference;
 
 	if(filled_locations != NULL)
-		*filled_locations = -1;
+		*filled_locations = pos.filled;
 
 	if(memory_pointer != NULL)
-		*memory_pointer = -1;
-
-	while((p = strsep(&s, " ")) != NULL) {
-		switch(p[0]) {
-			case 'R':
-				if(reference_location == NULL)
-					continue;
-
-				if((t = strchr(p, '+')) == NULL)
-					continue;
-				t++;
-
-				*reference_location = atoi(t);
-				break;
-			case 'F':
-				if(filled_locations == NULL)
-					continue;
-
-				if((t = strchr(p, '+')) == NULL)
-					continue;
-				t++;
-
-				*filled_locations = atoi(t);
-				break;
-			case 'L':
-				if(memory_pointer == NULL)
-					continue;
-
-				if((t = strchr(p, '+')) == NULL)
-					continue;
-				t++;
-
-				*memory_pointer = atoi(t);
-				break;
-		}
-	}
+		*memory_pointer = pos.pointer;
 
-	if(reference_location != NULL && *reference_location == -1)
+	if(reference_location != NULL && pos.reference == -1)
 		return -1;
 
-	if(filled_locations != NULL && *filled_locations == -1)
+	if(filled_locations != NULL && pos.filled == -1)
 		return -1;
 
-	if(memory_pointer != NULL && *memory_pointer == -1)
+	if(memory_pointer != NULL && pos.pointer == -1)
 		return -1;
 
-	// We go back one output array to determine the number of Final Storage Locations in one array
+	if(locations_per_array != NULL)
+		return logger_get_array_length(l, pos.pointer, pos.filled, locations_per_array);
+
+	return 0;
+}
+
+/* Determine the number of Final Storage Locations in one output array by
+   going back one array from the memory pointer */
+int logger_get_array_length(logger_t l, int memory_pointer, int filled_locations, int *locations_per_array)
+{
+	struct response r;
+	struct response_position back;
 
-	if(logger_command(l, "B", ls, 128) < 0)
+	if(logger_set_position(l, memory_pointer) < 0)
+		return -1;
+
+	if(logger_get_prompt(l) < 0)
 		return -1;
 
-	while((p = strsep(&ls, " ")) != NULL) {
-		switch(p[0]) {
-			case 'L':
-				if(locations_per_array == NULL)
-					continue;
+	l->mptr = -1;
 
-				if((t = strchr(p, '+')) == NULL)
-					continue;
-				t++;
+	if(logger_command(l, "B", &r) < 0)
+		return -1;
 
-				*locations_per_array = atoi(t);
-				*locations_per_array = *memory_pointer - *locations_per_array;
+	response_position(&r, &back);
 
-				if(*locations_per_array < 0) {
-					*locations_per_array += *filled_locations;
-				}
+	/* Remembered in case the download is aligned from the same place */
+	l->mptr = l->back_to = back.pointer;
+	l->back_from = memory_pointer;
 
-				break;
-		}
+	if(back.pointer != -1) {
+		*locations_per_array = memory_pointer - back.pointer;
+
+		if(*locations_per_array < 0)
+			*locations_per_array += filled_locations;
 	}
 
 	return 0;
 }
 
-/* Sets the MPTR location to the given position */
+/* Sets the MPTR location to the given position.  Nothing is sent if MPTR
+   is already known to be there, e.g. right after aligning to a record or
+   reading up to this position. */
 int logger_set_position(logger_t l, int position)
 {
-	char cmdbuf[16], buf[128], *p, *bptr;
+	char cmdbuf[16];
+	struct response r;
+	struct response_position pos;
+
+	if(l->mptr == position)
+		return 0;
+
+	l->mptr = -1;
 
 	if(logger_get_prompt(l) < 0) {
 		print("Lost communication with datalogger (Error getting prompt)\n");
@@ -606,34 +619,40 @@ int logger_set_position(logger_t l, int position)
 	}
 
 	sprintf(cmdbuf, "%dG", position);
-	if(logger_command(l, cmdbuf, buf, 128) < 0) {
+	if(logger_command(l, cmdbuf, &r) < 0) {
 		print("Error: Lost communication with datalogger (Couldn't send command)\n");
 		return -1;
 	}
 
-	bptr = buf;
-	while((p = strsep(&bptr, " ")) != NULL) {
-		if(p[0] == 'L' && p[1] != '\0' && p[2] != '\0') {
-			p += 2;
-			if((bptr = strchr(p, '.')) != NULL) 
-				*bptr = '\0';
+	response_position(&r, &pos);
 
-			if((unsigned)atoi(p) != position) {
-				print("Error while setting position: Returned position is different from specified!\n");
-				return -1;
-			}
+	if(pos.pointer == -1) {
+		print("Error while setting position: Protocol error!\n");
+		return -1;
+	}
 
-			return 0;
-		}
+	if(pos.pointer != position) {
+		print("Error while setting position: Returned position is different from specified!\n");
+		return -1;
 	}
 
-	print("Error while setting position: Protocol error!\n");
-	return -1;
+	l->mptr = position;
+
+	return 0;
 }
 
+/* Moves the location back to the start of a record.  If the same location
+   was already backed up from this session the answer is reused instead of
+   asking the logger again. */
 int logger_record_align(logger_t l, int *location)
 {
-	char new_status[128], *lp, *tp;
+	struct response r;
+	struct response_position pos;
+
+	if(*location == l->back_from && l->back_to != -1) {
+		*location = l->back_to;
+		return 0;
+	}
 
 	if(logger_set_position(l, *location) < 0)
 		return -1;
@@ -641,31 +660,77 @@ int logger_record_align(logger_t l, int *location)
 	if(logger_get_prompt(l) < 0)
 		return -1;
 
-	if(logger_command(l, "B", new_status, 128) < 0)
-		return -1;
+	l->mptr = -1;
 
-	if((lp = strstr(new_status, "L+")) == NULL)
+	if(logger_command(l, "B", &r) < 0)
 		return -1;
 
-	lp++;
-	if((tp = strchr(lp, ' ')) == NULL)
+	response_position(&r, &pos);
+
+	if(pos.pointer == -1)
 		return -1;
 
-	*tp = '\0';
-	*location = atoi(lp);
+	l->back_from = *location;
+	l->mptr = l->back_to = *location = pos.pointer;
 
 	return 0;
 }
 
-/* Add a byte to a checksum being computed.  Internal function */
-static void logger_checksum_add_byte(uint8_t s[2], uint8_t byte)
+/* One step of the datalogger's checksum: s0 = rol(s0) + s1 + byte, s1 = old
+   s0.  A macro so the state stays in registers even without optimisation. */
+#define LOGGER_CHECKSUM_STEP(a, b, byte) do {		\
+	uint8_t t_ = (a);				\
+	(a) = ((a) << 1 | (a) >> 7) + (b) + (byte);	\
+	(b) = t_;					\
+} while(0)
+
+/* Add a block of data to a checksum being computed.  Every byte depends on
+   the two before it, so there is nothing to gain from tables or SIMD; the
+   loop is unrolled to keep the per-byte cost down to the dependency chain
+   itself. */
+void logger_checksum_add(uint8_t s[2], const uint8_t *data, size_t len)
+{
+	uint8_t a = s[0], b = s[1];
+
+	for(; len >= 8; data += 8, len -= 8) {
+		LOGGER_CHECKSUM_STEP(a, b, data[0]);
+		LOGGER_CHECKSUM_STEP(a, b, data[1]);
+		LOGGER_CHECKSUM_STEP(a, b, data[2]);
+		LOGGER_CHECKSUM_STEP(a, b, data[3]);
+		LOGGER_CHECKSUM_STEP(a, b, data[4]);
+		LOGGER_CHECKSUM_STEP(a, b, data[5]);
+		LOGGER_CHECKSUM_STEP(a, b, data[6]);
+		LOGGER_CHECKSUM_STEP(a, b, data[7]);
+	}
+
+	for(; len > 0; data++, len--)
+		LOGGER_CHECKSUM_STEP(a, b, *data);
+
+	s[0] = a;
+	s[1] = b;
+}
+
+/* Take a block of data off the end of a checksum, giving the state before
+   it.  The old s0 is the new s1, and the old s1 is what is left of the new
+   s0 once the byte and the rotated old s0 are subtracted. */
+static void logger_checksum_remove(uint8_t s[2], const uint8_t *data, size_t len)
 {
-	uint8_t t1, t2; 
+	uint8_t a = s[0], b = s[1], t;
+
+	while(len > 0) {
+		t = b;
+		b = a - (uint8_t)(t << 1 | t >> 7) - data[--len];
+		a = t;
+	}
+
+	s[0] = a;
+	s[1] = b;
+}
 
-	t1 = s[1];
-	s[1] = s[0];
-	t2 = (s[0] << 1) | ((s[0] & 0x80) >> 7);
-	s[0] = t2 + t1 + byte; 
+/* Compare a computed checksum against the one sent by the datalogger */
+static int logger_checksum_matches(const uint8_t s[2], uint16_t logger_checksum)
+{
+	return logger_checksum == (s[1] | (s[0] << 8));
 }
 
 /*
@@ -676,82 +741,146 @@ static void logger_checksum_add_byte(uint8_t s[2], uint8_t byte)
 -1: read error/response error
 -2: bad checksum
 
+On a bad checksum the data is left in buffer and the checksum the
+datalogger sent is stored in checksum, so most of it can be salvaged.
 buffer should be large enough (i.e. 2 * locations bytes) to contain the
 requested amount of data, otherwise a buffer overflow will occur.
+
+If resync is zero the command is sent without first getting a prompt.  This
+is only safe straight after a successful read with pipelined set, when the
+prompt the logger prints after the checksum is still on its way to us; it is
+skipped along with the echo while scanning for the 'F'.  pipelined is set
+when another read follows at once, and otherwise that prompt is consumed
+here.
  */
-static ssize_t logger_read_raw_data(logger_t l, uint8_t *buffer, unsigned int locations)
+static ssize_t logger_read_raw_data(logger_t l, uint8_t *buffer, unsigned int locations, int resync, int pipelined, uint16_t *checksum)
 {
-	int i = 0;
-	uint8_t buf[16], c, s[2];
-	uint16_t logger_checksum, our_checksum;
-
-	if(logger_get_prompt(l) < 0)
+	ssize_t r;
+	size_t got;
+	int n, mptr = l->mptr;
+	uint8_t buf[16], s[2];
+	uint16_t logger_checksum;
+	struct iovec iov[2];
+	deadline_t deadline, sent, echoed;
+
+	if(resync && logger_get_prompt(l) < 0)
 		return -1;
 
 	snprintf((char *)buf, 16, "%dF\r", locations);
 
+	l->state = LOGGER_PENDING;
+	l->mptr = -1;
+
 	if(fd_write(l->p, buf, strlen((char *)buf)) < 0)
 		return -1;
 
-	do {
-		if(fd_read(l->p, &c, 1, RESPONSE_TIMEOUT) < 0)
-			return -1;
-	} while(c != 'F' && i++ < PROMPT_CHARACTERS);
+	l->round_trips++;
+
+	/* The echo, data and checksum together must arrive within the timeout */
+	sent = monotonic_ms();
+	deadline = deadline_within(l->timeout, l->deadline);
+
+	if((r = fd_scan(l->p, 'F', PROMPT_CHARACTERS, deadline)) <= 0) {
+		if(r == 0)
+			print("Error: Invalid response from datalogger during download\n");
 
-	if(c != 'F') {
-		print("Error: Invalid response from datalogger during download\n");
 		return -1;
 	}
 
+	/* The echo tells us how long a command takes to get through */
+	echoed = monotonic_ms();
+	if(l->chunk.rtt < 0)
+		l->chunk.rtt = echoed - sent;
+	else
+		l->chunk.rtt = (3 * l->chunk.rtt + (echoed - sent)) / 4;
+
 	/* Skip the CRLF */
-	if(fd_read(l->p, buf, 2, RESPONSE_TIMEOUT) < 0)
+	if(fd_read(l->p, buf, 2, deadline) < 0)
 		return -1;
 
-	/* At this point we should begin receiving binary data */
-	if(fd_read(l->p, buffer, 2 * locations, RESPONSE_TIMEOUT) < 0)
-		return -1;
+	/* At this point we should begin receiving binary data, which is read
+	   straight into the caller's buffer along with the checksum.  Each piece
+	   is added to the checksum as it arrives, so the result is ready as soon
+	   as the trailer lands. */
+	s[0] = 0xAA;
+	s[1] = 0xAA;
 
-	/* Read their checksum */
-	if(fd_read(l->p, buf, 2, RESPONSE_TIMEOUT) < 0)
-		return -1;
+	for(got = 0; got < 2 * locations + 2; got += r) {
+		if(got < 2 * locations) {
+			iov[0].iov_base = buffer + got;
+			iov[0].iov_len = 2 * locations - got;
+			iov[1].iov_base = buf;
+			iov[1].iov_len = 2;
+			n = 2;
+		} else {
+			iov[0].iov_base = buf + got - 2 * locations;
+			iov[0].iov_len = 2 * locations + 2 - got;
+			n = 1;
+		}
 
-	logger_checksum = buf[0] | (buf[1] << 8);
+		if((r = fd_readv_raw(l->p, iov, n, deadline)) < 0)
+			return -1;
 
-	s[0] = 0xAA;
-	s[1] = 0xAA;
+		if(got < 2 * locations)
+			logger_checksum_add(s, buffer + got, (size_t)r < iov[0].iov_len ? (size_t)r : iov[0].iov_len);
+	}
 
-	for(i = 0; i < 2 * locations; i++)
-		logger_checksum_add_byte(s, buffer[i]);
+	l->chunk.transfer = monotonic_ms() - echoed;
 
-	our_checksum = s[1] | (s[0] << 8);
+	logger_checksum = buf[0] | (buf[1] << 8);
 
-	if(logger_checksum != our_checksum) {
+	if(!logger_checksum_matches(s, logger_checksum)) {
 		print("Warning: Checksum mismatch!\n");
+
+		if(checksum != NULL)
+			*checksum = logger_checksum;
+
 		return -2;
 	}
 
+	if(!pipelined)
+		logger_expect_prompt(l, deadline);
+
+	/* MPTR has moved on past the data, unless it wrapped around */
+	if(mptr != -1 && mptr + locations <= l->filled)
+		l->mptr = mptr + locations;
+
 	return 0;
 }
 
-/* This is called when a checksum occurs in read_raw_data_range */
-static int logger_read_data_exception(logger_t l, uint8_t *buffer, unsigned int start_location, unsigned int locations_to_read)
+/* Read a range again from the given position, retrying while its checksum
+   fails */
+static int logger_refetch_data(logger_t l, uint8_t *buffer, unsigned int start_location, unsigned int locations)
 {
-	unsigned int read_locations, i;
-	int retval;
-
-	while(locations_to_read > 0) {
-		read_locations = locations_to_read < EXCEPTION_DATA_CHUNK_SIZE ? locations_to_read : EXCEPTION_DATA_CHUNK_SIZE;
+	int i = 0;
+	ssize_t r;
 
+	/* Every attempt advances MPTR, so each retry must reposition */
+	do {
 		if(logger_set_position(l, start_location) < 0)
 			return -1;
 
-		i = 0;
-		do {
-			if((retval = logger_read_raw_data(l, buffer, read_locations)) == -1)
-				return -1;
-		} while(retval == -2 && i++ < MAX_CHECKSUM_FAILURES);
+		if((r = logger_read_raw_data(l, buffer, locations, 1, 0, NULL)) == -1)
+			return -1;
+	} while(r == -2 && i++ < MAX_CHECKSUM_FAILURES);
 
-		if(retval == -2)
+	if(r == -2)
+		return -1;
+
+	l->chunk.refetched += locations;
+
+	return 0;
+}
+
+/* This is called when a read fails without delivering any usable data */
+static int logger_read_data_exception(logger_t l, uint8_t *buffer, unsigned int start_location, unsigned int locations_to_read)
+{
+	unsigned int read_locations;
+
+	while(locations_to_read > 0) {
+		read_locations = locations_to_read < EXCEPTION_DATA_CHUNK_SIZE ? locations_to_read : EXCEPTION_DATA_CHUNK_SIZE;
+
+		if(logger_refetch_data(l, buffer, start_location, read_locations) < 0)
 			return -1;
 
 		buffer += read_locations * 2;
@@ -762,30 +891,238 @@ static int logger_read_data_exception(logger_t l, uint8_t *buffer, unsigned int
 	return 0;
 }
 
-/* Read data from the datalogger, correcting checksum errors as they appear */
+/* 
+   Salvage a range that failed its checksum.  buffer holds what was received
+   and checksum is what the datalogger sent for the whole range.
+
+   The checksum can be run backwards, so the true checksum state is known at
+   both ends of the part still in doubt: at the front from the data read
+   again before it, and at the back by taking the data read again after it
+   out of the datalogger's checksum.  Pieces of about 1/RECOVERY_PIECES of
+   the range are read again alternately from the front and the back.  After
+   each one the old data left in between is run through the checksum, and
+   once it leads from the front state to the back state it is kept.  Once
+   no more than half the range is left in doubt it is read in one go.
+
+   An error in the first piece costs one piece and one in the last piece
+   two, and one in the middle the whole range in three reads.  Each read is
+   a G and F pair, so when the round trips a piece adds cost more than the
+   transfer it may save, the range is simply read again in one go.  Bytes
+   lost rather than corrupted never check out, so then the whole range is
+   always read again.
+ */
+static int logger_recover_data(logger_t l, uint8_t *buffer, unsigned int start_location, unsigned int locations, uint16_t checksum)
+{
+	unsigned int piece, front = 0, back = locations, n;
+	uint8_t s[2], e[2], t[2];
+	int from_back = 0;
+
+	piece = (locations / RECOVERY_PIECES + EXCEPTION_DATA_CHUNK_SIZE - 1) / EXCEPTION_DATA_CHUNK_SIZE * EXCEPTION_DATA_CHUNK_SIZE;
+
+	if(piece < EXCEPTION_DATA_CHUNK_SIZE)
+		piece = EXCEPTION_DATA_CHUNK_SIZE;
+
+	/* Averaged over where the error falls, quarters take 1.25 more G and F
+	   pairs than one read and save 5/16 of its transfer, so they only pay
+	   while a quarter takes longer than two round trips.  l->chunk.transfer
+	   is how long the failed read took. */
+	if(l->chunk.rtt > 0 && (int64_t)2 * l->chunk.rtt * locations >= (int64_t)l->chunk.transfer * piece)
+		piece = locations;
+
+	s[0] = 0xAA;
+	s[1] = 0xAA;
+	e[0] = checksum >> 8;
+	e[1] = checksum & 0xff;
+
+	while(front < back) {
+		n = back - front <= locations / 2 ? back - front : piece;
+
+		if(n > back - front)
+			n = back - front;
+
+		if(from_back) {
+			if(logger_refetch_data(l, buffer + 2 * (back - n), start_location + back - n, n) < 0)
+				return -1;
+
+			back -= n;
+			logger_checksum_remove(e, buffer + 2 * back, 2 * n);
+		} else {
+			if(logger_refetch_data(l, buffer + 2 * front, start_location + front, n) < 0)
+				return -1;
+
+			logger_checksum_add(s, buffer + 2 * front, 2 * n);
+			front += n;
+		}
+
+		from_back = !from_back;
+
+		t[0] = s[0];
+		t[1] = s[1];
+		logger_checksum_add(t, buffer + 2 * front, 2 * (back - front));
+
+		if(t[0] == e[0] && t[1] == e[1])
+			return 0;
+	}
+
+	return 0;
+}
+
+/* Change the chunk size, keeping track of what was chosen */
+static void logger_chunk_set(logger_t l, unsigned int size, const char *why)
+{
+	struct logger_chunk *c = &l->chunk;
+
+	if(size == c->size)
+		return;
+
+	debug("Chunk size %u -> %u locations (%s, rtt %d ms, read %d ms, %u/%u failed)\n",
+			c->size, size, why, c->rtt, c->transfer, c->failures, c->reads);
+
+	c->size = size;
+	c->changes++;
+
+	if(size < c->smallest)
+		c->smallest = size;
+	if(size > c->largest)
+		c->largest = size;
+}
+
+/* Additive increase: grow after a clean full-sized read while the command
+   round trip still costs more than 1/CHUNK_OVERHEAD_RATIO of the read, or
+   back towards the standard size once the line has been clean for a while */
+static void logger_chunk_success(logger_t l, unsigned int locations)
+{
+	struct logger_chunk *c = &l->chunk;
+	const char *why;
+
+	c->reads++;
+
+	if(c->fixed || locations < c->size)
+		return;
+
+	c->clean++;
+
+	if(c->size >= MAX_DATA_CHUNK_SIZE)
+		return;
+
+	if(c->rtt * CHUNK_OVERHEAD_RATIO > c->transfer)
+		why = "round trip dominates";
+	else if(c->size < STANDARD_DATA_CHUNK_SIZE && c->clean >= CHUNK_CLEAN_READS)
+		why = "reads clean again";
+	else
+		return;
+
+	c->clean = 0;
+
+	if(c->size + DATA_CHUNK_INCREMENT > MAX_DATA_CHUNK_SIZE)
+		logger_chunk_set(l, MAX_DATA_CHUNK_SIZE, why);
+	else
+		logger_chunk_set(l, c->size + DATA_CHUNK_INCREMENT, why);
+}
+
+/* Multiplicative decrease: halve after a failed read, as every failure
+   means re-reading data */
+static void logger_chunk_failure(logger_t l)
+{
+	struct logger_chunk *c = &l->chunk;
+
+	c->reads++;
+	c->failures++;
+	c->clean = 0;
+
+	if(c->fixed)
+		return;
+
+	if(c->size / 2 < MIN_DATA_CHUNK_SIZE)
+		logger_chunk_set(l, MIN_DATA_CHUNK_SIZE, "read failed");
+	else
+		logger_chunk_set(l, c->size / 2, "read failed");
+}
+
+/* Start from the round trip and chunk size an earlier session settled on */
+void logger_chunk_restore(logger_t l, int rtt, unsigned int size)
+{
+	struct logger_chunk *c = &l->chunk;
+
+	if(rtt >= 0)
+		c->rtt = rtt;
+
+	if(c->fixed || size == 0)
+		return;
+
+	if(size < MIN_DATA_CHUNK_SIZE)
+		size = MIN_DATA_CHUNK_SIZE;
+	if(size > MAX_DATA_CHUNK_SIZE)
+		size = MAX_DATA_CHUNK_SIZE;
+
+	c->size = c->smallest = c->largest = size;
+}
+
+/* Summarise the chunk sizes used during this session */
+void logger_chunk_report(logger_t l)
+{
+	struct logger_chunk *c = &l->chunk;
+
+	if(c->reads == 0)
+		return;
+
+	if(c->fixed)
+		print("Read %u chunks of %u locations, %u failed", c->reads, c->size, c->failures);
+	else
+		print("Read %u chunks, %u failed; size %u-%u locations, finished at %u (rtt %d ms)",
+				c->reads, c->failures, c->smallest, c->largest, c->size, c->rtt);
+
+	if(c->failures)
+		print("; %u locations read again\n", c->refetched);
+	else
+		print("\n");
+}
+
+/* Read data from the datalogger, correcting checksum errors as they appear.
+
+   In pipelined mode the next chunk is requested as soon as the previous
+   checksum has arrived instead of waiting for a fresh prompt, which saves a
+   round trip per chunk on slow links.  Any error falls back to a full
+   resynchronisation before the following chunk. */
 ssize_t logger_read_data(logger_t l, uint8_t *buffer, unsigned int start_location, unsigned int locations_to_read)
 {
 	unsigned int read_locations;
 	size_t locations_in_buffer = 0;
-
-	if(logger_set_position(l, start_location) < 0) {
-		print("Error communicating with datalogger (Error setting position)\n");
-		return -1;
-	}
+	int resync = 1, reposition = 1;
+	uint16_t checksum;
+	ssize_t r;
 
 	while(locations_to_read > 0) {
-		read_locations = locations_to_read < STANDARD_DATA_CHUNK_SIZE ? locations_to_read : STANDARD_DATA_CHUNK_SIZE;
+		read_locations = locations_to_read < l->chunk.size ? locations_to_read : l->chunk.size;
 
-		if(logger_read_raw_data(l, buffer, read_locations) < 0) {
+		/* Recovery leaves MPTR wherever its last read ended */
+		if(reposition) {
 			if(logger_set_position(l, start_location) < 0) {
 				print("Error communicating with datalogger (Error setting position)\n");
 				return -1;
 			}
 
-			if(logger_read_data_exception(l, buffer, start_location, read_locations) < 0) {
+			reposition = 0;
+		}
+
+		if((r = logger_read_raw_data(l, buffer, read_locations, resync || !l->pipeline,
+				l->pipeline && locations_to_read > read_locations, &checksum)) < 0) {
+			resync = 1;
+			reposition = 1;
+			logger_chunk_failure(l);
+
+			if(r == -2)
+				r = logger_recover_data(l, buffer, start_location, read_locations, checksum);
+			else
+				r = logger_read_data_exception(l, buffer, start_location, read_locations);
+
+			if(r < 0) {
 				print("Error communicating with datalogger (Error reading data)\n");
 				return -1;
 			}
+		} else {
+			resync = 0;
+			logger_chunk_success(l, read_locations);
 		}
 
 		buffer += read_locations * 2;
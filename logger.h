@@ -50,20 +50,57 @@
 #define MAX_RECORD_SIZE         100
 
 
+/* What we know about the datalogger's side of the conversation.  Once a
+   prompt has been read the logger is waiting for a command, so the next
+   command can be sent without asking for another prompt first. */
+enum logger_state {
+	LOGGER_UNKNOWN,		/* Nothing known, a prompt must be requested */
+	LOGGER_PROMPT,		/* Prompt consumed, ready for a command */
+	LOGGER_PENDING		/* Command sent, response not yet consumed */
+};
+
+/* Adaptive sizing of data reads.  The chunk grows while the command round
+   trip is a significant part of each read or the reads are clean again, and
+   is halved on every checksum failure.  See logger_chunk_success() in
+   logger.c. */
+struct logger_chunk {
+	unsigned int size;
+	unsigned int smallest, largest;
+	unsigned int reads, failures, changes;
+	unsigned int refetched;	/* Locations read again after failures */
+	unsigned int clean;	/* Clean full-sized reads since the size last changed */
+	int rtt;		/* Smoothed round trip in ms, -1 if unmeasured */
+	int transfer;		/* Duration of the last read in ms */
+	int fixed;		/* Size was set by the user */
+};
+
 typedef struct logger {
 	fd_t p;
+	enum logger_state state;
 	int security_level;
+	int timeout;
+	deadline_t deadline;	/* No exchange runs past this, 0 for none */
+	int pipeline;
+	struct logger_chunk chunk;
+	unsigned int round_trips;	/* Exchanges with the logger so far */
+	int filled;		/* Filled locations, -1 if not yet known */
+	int mptr;		/* Where MPTR is, -1 if unknown */
+	int back_from, back_to;	/* Last B command: MPTR before and after */
 } *logger_t;
 
-logger_t logger_create(fd_t s);
+logger_t logger_create(fd_t s, deadline_t deadline);
 void logger_destroy(logger_t l);
 
 int logger_set_security_level(logger_t l, char *password);
 void logger_calculate_real_time(time_t t, int* real_day, int* real_hour, int* real_minute, int* real_second, int* real_ysec);
 int logger_update_clock(logger_t l, int *skew);
 int logger_get_position(logger_t l, int *reference_location, int *filled_locations, int *memory_pointer, int *locations_per_array);
+int logger_get_array_length(logger_t l, int memory_pointer, int filled_locations, int *locations_per_array);
 int logger_set_position(logger_t l, int position);
 int logger_record_align(logger_t l, int *location);
+void logger_checksum_add(uint8_t s[2], const uint8_t *data, size_t len);
 ssize_t logger_read_data(logger_t l, uint8_t *buffer, unsigned int start_location, unsigned int locations_to_read);
+void logger_chunk_restore(logger_t l, int rtt, unsigned int size);
+void logger_chunk_report(logger_t l);
 
 #endif
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <ctype.h>
 #include <time.h>
 #include <string.h>
@@ -49,6 +50,11 @@
 #define DEVICE	"/dev/logger"
 #define PORT	2030
 
+static struct option long_options[] = {
+	{"deadline", required_argument, NULL, 'D'},
+	{NULL, 0, NULL, 0}
+};
+
 int check_arg_type(char *logger)
 {
 	int i, l = strlen(logger);
@@ -75,18 +81,46 @@ void usage()
 
 	print("Flags:\n");
 	print("  -d <device>\tCommunicate using the given serial device\n");
+	print("  -b <baud>\tLine speed for serial or modem communication\n");
 	print("  -p <port>\tConnect to datalogger using the given TCP/IP port\n");
 	print("  -l <location>\tLocation to begin reading from. Can also be a filename.\n");
 	print("  -c <code>\tUse the given security code\n");
 	print("  -o <file>\tOutput to the given file (- for stdout)\n");
+	print("  -s <file>\tRemember what is learnt about each datalogger in the\n");
+	print("           \tgiven file, to skip discovery on later runs\n");
+	print("  -j <file>\tJournal downloaded data to the given file, so an\n");
+	print("           \tinterrupted download resumes where it stopped\n");
+	print("  -N\t\tFetch the newest data first, then the older data.  If the\n");
+	print("           \tdownload is cut short the newest arrays are still saved\n");
+	print("  -D, --deadline <seconds>\n");
+	print("           \tFinish within the given time, saving as many whole\n");
+	print("           \tarrays as the measured link speed allows\n");
+	print("  -t <threads>\tDecode large downloads on up to the given number of\n");
+	print("           \tthreads, or 0 for one per processor (default 1)\n");
 	print("  -C\t\tDon't update datalogger's clock\n");
 	print("  -i\t\tForce interpretation of datalogger location as Internet address\n");
+	print("  -v\t\tVerbose operation (shows link tuning decisions)\n");
 	print("  -q\t\tQuiet operation (disables all messages)\n");
 	print("  -h\t\tDisplay this help\n");
 	print("\n");
 	print("Environment Variables:\n");
 	print("   MODEM_INITSTRING :\tWhen defined this string will be used to initialize\n");
 	print("                     \tthe modem.\n");
+	print("   CONNECT_TIMEOUT  :\tMilliseconds allowed for establishing a TCP/IP\n");
+	print("                     \tconnection (default 10000).\n");
+	print("   RESPONSE_TIMEOUT :\tMilliseconds allowed for each datalogger command\n");
+	print("                     \tand its response (default 40000).\n");
+	print("   DATA_CHUNK_SIZE  :\tLocations per data read, at most 1024.  Disables\n");
+	print("                     \tthe automatic sizing based on link quality.\n");
+	print("   PIPELINE_DOWNLOAD:\tSet to 1 to request each data chunk without\n");
+	print("                     \twaiting for a prompt after the previous one.\n");
+	print("   TCP_NODELAY, TCP_QUICKACK :\n");
+	print("                     \tSet to 0 to re-enable Nagle or delayed ACKs.\n");
+	print("   TCP_KEEPALIVE    :\tKeepalive idle,interval,count in seconds\n");
+	print("                     \t(default 10,5,3), or 0 to disable.\n");
+	print("   TCP_USER_TIMEOUT :\tMilliseconds unacknowledged data may remain\n");
+	print("                     \tbefore the connection is dropped (default 30000).\n");
+	print("   TCP_RCVBUF       :\tSocket receive buffer size in bytes.\n");
 	exit(-1);
 }
 
@@ -98,27 +132,34 @@ void usage_full()
 
 int main(int argc, char **argv)
 {
-	int r, end_location;
+	int r, end_location = -1;
 
 	/* Settings */
 	int mode = -1;	/* 0: Local serial  1: Modem  2: TCP/IP */
 	int clockupd = -1;
 	int port = PORT;
+	int baud = 0;
 	int startloc = -1;
+	int newest_first = 0;
+	int deadline = 0;
+	int threads = 1;
 	long lval = -1;
 	char *device = DEVICE;
 	char *security_code = NULL;
 	char *outfile = NULL;
 	char *locfile = NULL;
+	char *statefile = NULL;
+	char *journalfile = NULL;
 	char *endptr = NULL;
 	char *logger = NULL;
 	time_t c;
 	struct tm *tm;
+	struct download_opts opts;
 
 	FILE *output_file;
 	FILE *location_file;
 
-	while((r = getopt(argc, argv, "d:p:l:c:o:s:Ciqh")) != -1) {
+	while((r = getopt_long(argc, argv, "d:b:p:l:c:o:s:j:D:t:NCivqh", long_options, NULL)) != -1) {
 		switch(r) {
 			case 'd':
 				if(mode != -1) {
@@ -128,6 +169,13 @@ int main(int argc, char **argv)
 
 				mode = 0;
 				device = optarg;
+				break;
+			case 'b':
+				if((baud = atoi(optarg)) <= 0) {
+					print("Error: Invalid baud rate specified: %s\n", optarg);
+					usage();
+				}
+
 				break;
 			case 'p':
 				if(mode != -1 && mode != 2) {
@@ -195,6 +243,32 @@ int main(int argc, char **argv)
 			case 'o':
 				outfile = strdup(optarg);
 				break;
+			case 's':
+				statefile = optarg;
+				break;
+			case 'j':
+				journalfile = optarg;
+				break;
+			case 'D':
+				if((deadline = atoi(optarg)) <= 0) {
+					print("Error: Invalid deadline specified: %s\n", optarg);
+					usage();
+				}
+
+				break;
+			case 't':
+				if((threads = atoi(optarg)) < 0 || !isdigit(optarg[0])) {
+					print("Error: Invalid number of threads specified: %s\n", optarg);
+					usage();
+				}
+
+				if(threads == 0)
+					threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+				break;
+			case 'N':
+				newest_first = 1;
+				break;
 			case 'C':
 				clockupd = 0;
 				break;
@@ -206,6 +280,9 @@ int main(int argc, char **argv)
 
 				mode = 2;
 				break;
+			case 'v':
+				set_verbose();
+				break;
 			case 'q':
 				set_quiet();
 				break;
@@ -274,15 +351,24 @@ int main(int argc, char **argv)
 		}
 	}
 
+	opts.security_code = security_code;
+	opts.clockupd = clockupd;
+	opts.start_location = startloc;
+	opts.state_file = statefile;
+	opts.journal_file = journalfile;
+	opts.newest_first = newest_first;
+	opts.deadline = deadline;
+	opts.threads = threads;
+
 	switch(mode) {
 		case 0:
-			end_location = download_serial(output_file, device, security_code, clockupd, startloc);
+			end_location = download_serial(output_file, device, baud, &opts);
 			break;
 		case 1:
-			end_location = download_modem(output_file, logger, device, security_code, clockupd, startloc);
+			end_location = download_modem(output_file, logger, device, baud, &opts);
 			break;
 		case 2:
-			end_location = download_tcpip(output_file, logger, port, security_code, clockupd, startloc);
+			end_location = download_tcpip(output_file, logger, port, &opts);
 			break;
 	}
 
@@ -33,19 +33,23 @@
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
-#include <sys/time.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <errno.h>
 
+#include "fd.h"
 #include "modem.h"
 #include "output.h"
+#include "tty.h"
 #include "xmalloc.h"
 
-/* Baud rate to use (datalogger supports max of 9600) */
+/* Default baud rate to use (datalogger supports max of 9600) */
 #define BAUDRATE B9600
 
 /* Number of times to send ATZ to modem before giving up */
@@ -57,12 +61,24 @@
 /* Number of times to send ATH to modem before giving up */
 #define HANGUP_RETRIES  20
 
+/* Most buffers modem_commandv will write in one call, including the CRLF it
+   appends to the command */
+#define MODEM_MAX_IOV   8
 
-/* This initializes the modem and returns a handle to the structure */
-modem_t modem_init(char *device)
+
+/* This initializes the modem and returns a handle to the structure.  A baud
+   rate of 0 selects the default. */
+modem_t modem_init(char *device, int baud)
 {
 	modem_t m = ALLOC(modem);
 	struct termios newtio;
+	speed_t speed = BAUDRATE;
+
+	if(baud > 0 && (speed = tty_speed(baud)) == B0) {
+		print("Error: Unsupported line speed %d\n", baud);
+		xfree(m);
+		return NULL;
+	}
 
 	if((m->fd = open(device, O_RDWR | O_NOCTTY)) < 0) {
 		perror(device);
@@ -85,8 +101,8 @@ modem_t modem_init(char *device)
 	}
 
 	memset(&newtio, 0, sizeof(newtio));
-	cfsetospeed(&newtio, (speed_t)BAUDRATE);
-	cfsetispeed(&newtio, (speed_t)BAUDRATE);
+	cfsetospeed(&newtio, speed);
+	cfsetispeed(&newtio, speed);
 	newtio.c_cflag = CRTSCTS | CS8 | CLOCAL | CREAD; /* | BAUDRATE */
 	newtio.c_iflag = IGNPAR | ICRNL;
 	newtio.c_oflag = 0;
@@ -163,23 +179,21 @@ int modem_flush(modem_t m)
 	return 0;
 }
 
+/* Read from the modem, waiting up to timeout milliseconds for data */
 ssize_t modem_read(modem_t m, void *buf, size_t nbytes, int timeout)
 {
-	fd_set f;
-	struct timeval tv;
+	struct pollfd pfd;
+	int r;
 
-	tv.tv_sec = timeout/1000;
-	tv.tv_usec = timeout%1000;
+	pfd.fd = m->fd;
+	pfd.events = POLLIN;
 
-	FD_ZERO(&f);
-	FD_SET(m->fd, &f);
-
-	if(select(m->fd + 1, &f, NULL, NULL, &tv) < 0) {
-		perror("select");
+	if((r = poll(&pfd, 1, timeout)) < 0) {
+		perror("poll");
 		return -1;
 	}
 
-	if(!FD_ISSET(m->fd, &f)) 
+	if(r == 0) 
 		return -1;
 
 	return read(m->fd, buf, nbytes);
@@ -258,17 +272,70 @@ int modem_reset(modem_t m)
 	return 0;
 }
 
+/* Write the given buffers with a single system call where possible.  The
+   iovec array is consumed in the process. */
+static ssize_t modem_writev(modem_t m, struct iovec *iov, int iovcnt)
+{
+	ssize_t ret, total = 0;
+
+	while(iovcnt > 0) {
+		if((ret = writev(m->fd, iov, iovcnt)) < 0) {
+			if(errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		total += ret;
+		fd_iov_advance(&iov, &iovcnt, ret);
+	}
+
+	return total;
+}
+
+/* Compare a string against the concatenation of the given buffers */
+static int modem_echo_match(struct iovec *iov, int iovcnt, char *str)
+{
+	int i;
+
+	for(i = 0; i < iovcnt; i++) {
+		if(strncmp(iov[i].iov_base, str, iov[i].iov_len))
+			return 0;
+
+		str += iov[i].iov_len;
+	}
+
+	return *str == '\0';
+}
+
 ssize_t modem_command(modem_t m, char *instr, char *outstr, int len, int timeout)
 {
-	int x = 0;
+	struct iovec iov[1];
+
+	iov[0].iov_base = instr;
+	iov[0].iov_len = strlen(instr);
+
+	return modem_commandv(m, iov, 1, outstr, len, timeout);
+}
+
+/* Send a command made up of several pieces, followed by CRLF, in one write */
+ssize_t modem_commandv(modem_t m, struct iovec *iov, int iovcnt, char *outstr, int len, int timeout)
+{
+	int i, x = 0;
 	char c;
+	struct iovec v[MODEM_MAX_IOV];
 
-	if(write(m->fd, instr, strlen(instr)) < 0) {
-		perror("write");
+	/* Leave room for the line terminator */
+	if(iovcnt > MODEM_MAX_IOV - 1)
 		return -1;
-	}
 
-	if(write(m->fd, "\r\n", 2) < 0) {
+	for(i = 0; i < iovcnt; i++)
+		v[i] = iov[i];
+
+	v[iovcnt].iov_base = "\r\n";
+	v[iovcnt].iov_len = 2;
+
+	if(modem_writev(m, v, iovcnt + 1) < 0) {
 		perror("write");
 		return -1;
 	}
@@ -288,7 +355,7 @@ ssize_t modem_command(modem_t m, char *instr, char *outstr, int len, int timeout
 
 			outstr[x++] = '\0';
 
-			if(!strcmp(instr, outstr)) {
+			if(modem_echo_match(iov, iovcnt, outstr)) {
 				x = 0;
 				continue;
 			}
@@ -305,21 +372,24 @@ ssize_t modem_command(modem_t m, char *instr, char *outstr, int len, int timeout
 	return x;
 }
 
-int modem_dial(modem_t m, char *number)
+/* Dial a number, waiting for the answer no longer than DIAL_TIMEOUT or past
+   the deadline (0 for none) */
+int modem_dial(modem_t m, char *number, deadline_t deadline)
 {
-	char *cmd, ret[32];
+	char ret[32];
+	struct iovec iov[2];
+	int timeout = DIAL_TIMEOUT;
 
-	cmd = (char *)xmalloc(strlen(number) + 5);
+	if(deadline != 0 && deadline_remaining(deadline) / 1000 < timeout)
+		timeout = deadline_remaining(deadline) / 1000;
 
-	strcpy(cmd, "ATDT");
-	strcat(cmd, number);
+	iov[0].iov_base = "ATDT";
+	iov[0].iov_len = 4;
+	iov[1].iov_base = number;
+	iov[1].iov_len = strlen(number);
 
-	if(modem_command(m, cmd, ret, 32, DIAL_TIMEOUT) < 0) {
-		free(cmd);
+	if(modem_commandv(m, iov, 2, ret, 32, timeout) < 0)
 		return -1;
-	}
-
-	free(cmd);
 
 	if(strncmp(ret, "CONNECT", 7) != 0) {
 		if(strstr(ret, "BUSY") != NULL) {
@@ -356,13 +426,8 @@ int modem_hangup(modem_t m)
 
 	modem_flush(m);
 
-	if(write(m->fd, "\r\n", 2) < 0) {
-		perror("write");
-		return -1;
-	}
-
 	// End the call for the datalogger -- should go into the logger.c
-	if(write(m->fd, "E\r\n", 3) < 0) {
+	if(write(m->fd, "\r\nE\r\n", 5) < 0) {
 		perror("write");
 		return -1;
 	}
@@ -35,14 +35,17 @@
 #define MODEM_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 
+#include "deadline.h"
+
 typedef struct modem {
 	int fd;
 	struct termios tio;
 } *modem_t;
 
-modem_t modem_init(char *device);
+modem_t modem_init(char *device, int baud);
 void modem_close(modem_t m);
 void modem_destroy(modem_t m);
 
@@ -50,8 +53,8 @@ int modem_flush(modem_t m);
 ssize_t modem_read(modem_t m, void *buf, size_t nbytes, int timeout);
 int modem_reset(modem_t m);
 ssize_t modem_command(modem_t m, char *instr, char *outstr, int len, int timeout);
-ssize_t modem_command(modem_t m, char *instr, char *outstr, int len, int timeout);
-int modem_dial(modem_t m, char *number);
+ssize_t modem_commandv(modem_t m, struct iovec *iov, int iovcnt, char *outstr, int len, int timeout);
+int modem_dial(modem_t m, char *number, deadline_t deadline);
 int modem_hangup(modem_t m);
 
 
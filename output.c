@@ -38,6 +38,7 @@
 #include "output.h"
 
 static int quiet = 0;
+static int verbose = 0;
 
 void print(const char *format, ...)
 {
@@ -63,6 +64,20 @@ void fatal(const char *format, ...)
 	//exit(EXIT_FAILURE);
 }
 
+/* Like print(), but only shown when verbose output was requested */
+void debug(const char *format, ...)
+{
+	va_list ap;
+
+	if(quiet || !verbose)
+		return;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	fflush(stderr);
+	va_end(ap);
+}
+
 void draw_bar(int cur, int max)
 {
 	int p = (cur * 100) / max, b = p / 5, i;
@@ -88,3 +103,8 @@ void set_quiet()
 {
 	quiet = 1;
 }
+
+void set_verbose()
+{
+	verbose = 1;
+}
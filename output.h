@@ -36,7 +36,9 @@
 
 void print(const char *format, ...);
 void fatal(const char *format, ...);
+void debug(const char *format, ...);
 void draw_bar(int cur, int max);
 void set_quiet();
+void set_verbose();
 
 #endif
@@ -0,0 +1,89 @@
+/*
+   range.c - Mapping downloads onto the final storage ring
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+
+#include "range.h"
+
+/* Split the locations from start up to (but not including) end into runs of
+   consecutive locations, oldest first.  When the download wraps, location
+   filled itself is not part of it, as has always been the case.  Returns the
+   number of runs. */
+int range_split(int start, int end, int filled, struct range seg[RANGE_SEGMENTS])
+{
+	int n = 0;
+
+	if(start <= end) {
+		if(end > start) {
+			seg[n].location = start;
+			seg[n].count = end - start;
+			seg[n].offset = 0;
+			n++;
+		}
+
+		return n;
+	}
+
+	if(filled > start) {
+		seg[n].location = start;
+		seg[n].count = filled - start;
+		seg[n].offset = 0;
+		n++;
+	}
+
+	if(end > 1) {
+		seg[n].location = 1;
+		seg[n].count = end - 1;
+		seg[n].offset = n ? seg[0].count : 0;
+		n++;
+	}
+
+	return n;
+}
+
+int range_total(const struct range *seg, int nseg)
+{
+	return nseg ? seg[nseg - 1].offset + seg[nseg - 1].count : 0;
+}
+
+/* Find the run holding the location at the given offset into the download */
+const struct range *range_find(const struct range *seg, int nseg, int offset)
+{
+	int i;
+
+	for(i = 0; i < nseg; i++)
+		if(offset >= seg[i].offset && offset < seg[i].offset + seg[i].count)
+			return &seg[i];
+
+	return NULL;
+}
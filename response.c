@@ -0,0 +1,244 @@
+/*
+   response.c - Incremental parser for datalogger command responses
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "response.h"
+
+/* The security reply's checksum is a byte sum modulo RESPONSE_SUM_MODULO */
+#define RESPONSE_SUM_MODULO	8192
+
+/* Forget the current line.  Also used on a prompt, as only what follows the
+   last prompt on a line is part of the reply. */
+static void response_line_reset(struct response *r)
+{
+	r->epos = 0;
+	r->mismatch = 0;
+	r->empty = 1;
+	r->in_field = 0;
+	r->nfields = 0;
+}
+
+void response_init(struct response *r, const char *echo)
+{
+	r->echo = echo;
+	r->echoed = 0;
+	r->echo_optional = 0;
+	r->lines = 0;
+	r->done = 0;
+	r->error = 0;
+	r->sum = 0;
+
+	response_line_reset(r);
+}
+
+/* A letter starts a new field, which holds a sign and up to RESPONSE_PARTS
+   ':' separated numbers.  Anything after a '.' is ignored up to the next
+   space, since the logger pads its locations with a trailing dot. */
+static void response_field_byte(struct response *r, uint8_t c)
+{
+	struct response_field *f;
+
+	if(isalpha(c)) {
+		r->in_field = 0;
+
+		if(r->nfields == RESPONSE_FIELDS)
+			return;
+
+		f = &r->field[r->nfields++];
+		f->letter = c;
+		f->sign = 1;
+		f->parts = 0;
+		f->sum = r->sum;
+		memset(f->value, 0, sizeof(f->value));
+
+		r->in_field = 1;
+		r->part = 0;
+		r->skip = 0;
+		return;
+	}
+
+	if(!r->in_field)
+		return;
+
+	f = &r->field[r->nfields - 1];
+
+	if(c == ' ') {
+		r->in_field = 0;
+		return;
+	}
+
+	if(r->skip)
+		return;
+
+	if(isdigit(c)) {
+		if(r->part < RESPONSE_PARTS) {
+			f->value[r->part] = f->value[r->part] * 10 + (c - '0');
+			f->parts = r->part + 1;
+		}
+	} else if(c == ':')
+		r->part++;
+	else if(c == '-')
+		f->sign = -1;
+	else if(c == '.')
+		r->skip = 1;
+}
+
+/* A line that is nothing but the echo confirms the command went through.
+   The first other line after it is the reply; any other line before it
+   means the logger is answering something else, unless the echo is
+   optional. */
+static void response_end_line(struct response *r)
+{
+	r->lines++;
+
+	if(r->empty)
+		return;
+
+	if(!r->mismatch && r->echo[r->epos] == '\0')
+		r->echoed = 1;
+	else if(r->echoed || r->echo_optional)
+		r->done = 1;
+	else
+		r->error = 1;
+}
+
+/* Feed received bytes to the parser.  Returns how many were used, which is
+   less than len once the reply is complete or an error was found; the rest
+   belongs to whatever follows. */
+size_t response_feed(struct response *r, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	for(i = 0; i < len && !r->done && !r->error; i++) {
+		if(p[i] != '*')
+			r->sum = (r->sum + p[i]) % RESPONSE_SUM_MODULO;
+
+		switch(p[i]) {
+			case '\r':
+				break;
+			case '*':
+				response_line_reset(r);
+				break;
+			case '\n':
+				response_end_line(r);
+
+				if(!r->done)
+					response_line_reset(r);
+
+				break;
+			default:
+				r->empty = 0;
+
+				if(!r->mismatch && r->echo[r->epos] == p[i])
+					r->epos++;
+				else
+					r->mismatch = 1;
+
+				response_field_byte(r, p[i]);
+		}
+	}
+
+	return i;
+}
+
+/* Find the first field of the reply with the given letter and a value */
+const struct response_field *response_field(const struct response *r, char letter)
+{
+	int i;
+
+	for(i = 0; i < r->nfields; i++)
+		if(r->field[i].letter == letter && r->field[i].parts > 0)
+			return &r->field[i];
+
+	return NULL;
+}
+
+static long response_value(const struct response *r, char letter, int part)
+{
+	const struct response_field *f;
+
+	if((f = response_field(r, letter)) == NULL || f->parts <= part)
+		return -1;
+
+	return f->sign * f->value[part];
+}
+
+int response_position(const struct response *r, struct response_position *p)
+{
+	if(!r->done)
+		return -1;
+
+	p->reference = response_value(r, 'R', 0);
+	p->filled = response_value(r, 'F', 0);
+	p->pointer = response_value(r, 'L', 0);
+
+	return 0;
+}
+
+/* Fails without a time.  A missing day reads as zero. */
+int response_clock(const struct response *r, struct response_clock *c)
+{
+	const struct response_field *f;
+
+	if(!r->done || (f = response_field(r, 'T')) == NULL)
+		return -1;
+
+	c->hour = f->value[0];
+	c->minute = f->value[1];
+	c->second = f->value[2];
+	c->day = 0;
+
+	if((f = response_field(r, 'D')) != NULL)
+		c->day = f->sign * f->value[0];
+
+	return 0;
+}
+
+/* Fails if the reply carries no checksum at all */
+int response_security(const struct response *r, struct response_security *s)
+{
+	const struct response_field *f;
+
+	if(!r->done || (f = response_field(r, 'C')) == NULL)
+		return -1;
+
+	s->valid = (f->value[0] == f->sum);
+	s->level = response_value(r, 'S', 0);
+
+	return 0;
+}
@@ -0,0 +1,101 @@
+/*
+   response.h - Incremental parser for datalogger command responses
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <sys/types.h>
+
+/* RESPONSE_FIELDS is the most fields kept from one response line, and
+   RESPONSE_PARTS the most ':' separated numbers kept in one field (the
+   clock's T field has three).  Anything beyond these is ignored. */
+#define RESPONSE_FIELDS		8
+#define RESPONSE_PARTS		3
+
+/* One field of a status line, such as "L+12345." or "T12:34:56" */
+struct response_field {
+	char letter;
+	int sign;
+	int parts;		/* Number of values that had digits */
+	long value[RESPONSE_PARTS];
+	unsigned int sum;	/* Byte sum of the response up to the letter */
+};
+
+/* Parser state.  Bytes are fed in as they arrive and nothing is copied, so
+   a response may be split across reads at any point. */
+struct response {
+	const char *echo;	/* The command, as the logger echoes it */
+	size_t epos;		/* How much of the echo the line matched */
+	int mismatch;		/* The line isn't the echo */
+	int empty;		/* Nothing but CR seen on the line yet */
+	int echoed;		/* The echo line has been seen */
+	int echo_optional;	/* A reply may come without the echo */
+	int lines;
+	int done;		/* The response line is complete */
+	int error;		/* A line other than the echo came first */
+	unsigned int sum;	/* Byte sum, excluding prompts, modulo 8192 */
+	int in_field, part, skip;
+	int nfields;
+	struct response_field field[RESPONSE_FIELDS];
+};
+
+/* What the A, B and G commands report.  Fields missing from the reply are
+   left at -1. */
+struct response_position {
+	long reference;		/* R */
+	long filled;		/* F */
+	long pointer;		/* L */
+};
+
+/* What the C command reports.  A reply without the time is invalid. */
+struct response_clock {
+	long day;		/* D */
+	long hour, minute, second;	/* T */
+};
+
+/* What the L command reports.  The logger sends the sum of the bytes of
+   its reply up to the C as a check on the line. */
+struct response_security {
+	long level;		/* S, or -1 if no new level was granted */
+	int valid;		/* C matched the byte sum */
+};
+
+void response_init(struct response *r, const char *echo);
+size_t response_feed(struct response *r, const void *data, size_t len);
+const struct response_field *response_field(const struct response *r, char letter);
+
+int response_position(const struct response *r, struct response_position *p);
+int response_clock(const struct response *r, struct response_clock *c);
+int response_security(const struct response *r, struct response_security *s);
+
+#endif
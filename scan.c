@@ -0,0 +1,225 @@
+/*
+   scan.c - Fast search for special words in final storage data
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+/* Nearly every location holds a low-res value, whose high byte never has
+   all of SPECIAL_BITS set.  Array headers and both halves of a hi-res value
+   do, and headers have all of HEADER_BITS set as well.  The kernels below
+   turn SCAN_BLOCK locations at a time into bitmasks of these special words,
+   so callers only look closer at the few that matter. */
+#define SPECIAL_BITS	0x1c
+#define HEADER_BITS	0xfc
+
+/* Classify up to SCAN_BLOCK locations one by one */
+static uint64_t scan_scalar(const uint8_t *buffer, size_t count, uint64_t *headers)
+{
+	uint64_t special = 0, header = 0;
+	size_t i;
+
+	for(i = 0; i < count; i++) {
+		if((buffer[i * 2] & SPECIAL_BITS) == SPECIAL_BITS)
+			special |= (uint64_t)1 << i;
+
+		if((buffer[i * 2] & HEADER_BITS) == HEADER_BITS)
+			header |= (uint64_t)1 << i;
+	}
+
+	*headers = header;
+
+	return special;
+}
+
+static uint64_t scan_block_scalar(const uint8_t *buffer, uint64_t *headers)
+{
+	return scan_scalar(buffer, SCAN_BLOCK, headers);
+}
+
+#ifdef SCAN_X86
+/* 16 locations per step: the high byte of each is the low half of a 16 bit
+   lane, so masking off the other half and packing two registers gives the
+   high bytes of 16 locations in order */
+__attribute__((target("sse2")))
+static uint64_t scan_block_sse2(const uint8_t *buffer, uint64_t *headers)
+{
+	const __m128i low = _mm_set1_epi16(0x00ff);
+	const __m128i special = _mm_set1_epi8(SPECIAL_BITS);
+	const __m128i header = _mm_set1_epi8((char)HEADER_BITS);
+	uint64_t s = 0, h = 0;
+	__m128i a, b, hi;
+	int i;
+
+	for(i = 0; i < SCAN_BLOCK; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(buffer + i * 2));
+		b = _mm_loadu_si128((const __m128i *)(buffer + i * 2 + 16));
+		hi = _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+
+		s |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(hi, special), special)) << i;
+		h |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(hi, header), header)) << i;
+	}
+
+	*headers = h;
+
+	return s;
+}
+
+/* 32 locations per step.  Packing works within each 128 bit half, which
+   leaves the quarters out of order until they are permuted back. */
+__attribute__((target("avx2")))
+static uint64_t scan_block_avx2(const uint8_t *buffer, uint64_t *headers)
+{
+	const __m256i low = _mm256_set1_epi16(0x00ff);
+	const __m256i special = _mm256_set1_epi8(SPECIAL_BITS);
+	const __m256i header = _mm256_set1_epi8((char)HEADER_BITS);
+	uint64_t s = 0, h = 0;
+	__m256i a, b, hi;
+	int i;
+
+	for(i = 0; i < SCAN_BLOCK; i += 32) {
+		a = _mm256_loadu_si256((const __m256i *)(buffer + i * 2));
+		b = _mm256_loadu_si256((const __m256i *)(buffer + i * 2 + 32));
+		hi = _mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low));
+		hi = _mm256_permute4x64_epi64(hi, _MM_SHUFFLE(3, 1, 2, 0));
+
+		s |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(hi, special), special)) << i;
+		h |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(hi, header), header)) << i;
+	}
+
+	*headers = h;
+
+	return s;
+}
+#endif
+
+static scan_t kernel = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/* One of the SCAN_ kernels, or NULL if this CPU or build can't run it */
+scan_t scan_kernel_get(int which)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+#endif
+
+	switch(which) {
+		case SCAN_SCALAR:
+			return scan_block_scalar;
+#ifdef SCAN_X86
+		case SCAN_SSE2:
+			return __builtin_cpu_supports("sse2") ? scan_block_sse2 : NULL;
+		case SCAN_AVX2:
+			return __builtin_cpu_supports("avx2") ? scan_block_avx2 : NULL;
+#endif
+	}
+
+	return NULL;
+}
+
+/* Pick the fastest kernel the CPU supports */
+static void scan_pick_kernel()
+{
+	int which;
+
+	for(which = SCAN_KERNELS - 1; (kernel = scan_kernel_get(which)) == NULL; which--)
+		;
+}
+
+/* The kernel, picked on first use by whichever thread gets there first */
+static scan_t scan_kernel()
+{
+	pthread_once(&kernel_once, scan_pick_kernel);
+
+	return kernel;
+}
+
+/* Classify count locations, at most SCAN_BLOCK.  Bit i of the result is set
+   if location i is an array header or half of a hi-res value, and bit i of
+   *headers if it is an array header. */
+uint64_t scan_block(const uint8_t *buffer, size_t count, uint64_t *headers)
+{
+	uint64_t h;
+
+	if(headers == NULL)
+		headers = &h;
+
+	if(count < SCAN_BLOCK)
+		return scan_scalar(buffer, count, headers);
+
+	return scan_kernel()(buffer, headers);
+}
+
+/* Find the first array header from location from onwards among the count
+   locations in buffer.  Returns count if there is none. */
+size_t scan_next_header(const uint8_t *buffer, size_t from, size_t count)
+{
+	uint64_t h;
+	size_t n;
+
+	for(; from < count; from += n) {
+		n = count - from < SCAN_BLOCK ? count - from : SCAN_BLOCK;
+		scan_block(buffer + from * 2, n, &h);
+
+		if(h != 0)
+			return from + __builtin_ctzll(h);
+	}
+
+	return count;
+}
+
+/* Find the last array header among the first before locations in buffer.
+   Returns before if there is none. */
+size_t scan_prev_header(const uint8_t *buffer, size_t before)
+{
+	uint64_t h;
+	size_t n, from = before;
+
+	while(from > 0) {
+		n = from < SCAN_BLOCK ? from : SCAN_BLOCK;
+		from -= n;
+		scan_block(buffer + from * 2, n, &h);
+
+		if(h != 0)
+			return from + 63 - __builtin_clzll(h);
+	}
+
+	return before;
+}
@@ -0,0 +1,58 @@
+/*
+   scan.h - Fast search for special words in final storage data
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+/* Locations classified by one call to scan_block(), one bit each */
+#define SCAN_BLOCK	64
+
+/* The kernels scan_block() picks between at run time.  Each classifies a
+   whole block; scan_kernel_get() hands them out so tests and benchmarks can
+   run every one the CPU supports, not just the one picked. */
+#define SCAN_SCALAR	0
+#define SCAN_SSE2	1
+#define SCAN_AVX2	2
+#define SCAN_KERNELS	3
+
+typedef uint64_t (*scan_t)(const uint8_t *buffer, uint64_t *headers);
+
+scan_t scan_kernel_get(int which);
+uint64_t scan_block(const uint8_t *buffer, size_t count, uint64_t *headers);
+size_t scan_next_header(const uint8_t *buffer, size_t from, size_t count);
+size_t scan_prev_header(const uint8_t *buffer, size_t before);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+   state.c - What earlier sessions learnt about each datalogger
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "state.h"
+#include "output.h"
+
+/* The state file holds one line per logger:
+
+     key<TAB>memory_pointer filled_locations locations_per_array rtt chunk_size baud aligned_start aligned_back gap_start gap_count
+
+   The key ends at the tab, as dial strings and the like may contain
+   spaces.
+
+   It is always replaced as a whole through a temporary file and rename(),
+   so a crash leaves either the old or the new version behind.  The new
+   file keeps the mode of the one it replaces or, if there was none, gets
+   STATE_MODE less the umask as if fopen() had created it. */
+#define STATE_FORMAT	"%d %d %d %d %d %d %d %d %d %d"
+#define STATE_FIELDS	10
+#define STATE_MODE	0644
+
+/* STATE_LINE_SIZE is the longest line read from the state file */
+#define STATE_LINE_SIZE	512
+
+static int state_parse(const char *line, char *key, struct state_entry *s)
+{
+	const char *values;
+
+	if((values = strchr(line, '\t')) == NULL)
+		return -1;
+
+	if(values - line >= STATE_KEY_SIZE)
+		return -1;
+
+	memcpy(key, line, values - line);
+	key[values - line] = '\0';
+
+	return sscanf(values + 1, STATE_FORMAT, &s->memory_pointer, &s->filled_locations,
+			&s->locations_per_array, &s->rtt, &s->chunk_size, &s->baud,
+			&s->aligned_start, &s->aligned_back, &s->gap_start,
+			&s->gap_count) == STATE_FIELDS ? 0 : -1;
+}
+
+/* Look up the logger with the given key.  Returns 0 whether or not it was
+   found, leaving s->valid clear if it wasn't, or -1 if the file exists but
+   couldn't be read. */
+int state_load(const char *file, const char *key, struct state_entry *s)
+{
+	char line[STATE_LINE_SIZE], k[STATE_KEY_SIZE];
+	struct state_entry e;
+	FILE *f;
+
+	memset(s, 0, sizeof(*s));
+
+	if((f = fopen(file, "r")) == NULL)
+		return 0;
+
+	while(fgets(line, sizeof(line), f) != NULL) {
+		if(state_parse(line, k, &e) < 0 || strcmp(k, key))
+			continue;
+
+		*s = e;
+		s->valid = 1;
+		break;
+	}
+
+	if(ferror(f)) {
+		print("Warning: Couldn't read state file '%s'\n", file);
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+/* The mode for a new state file to replace file with */
+static mode_t state_mode(const char *file)
+{
+	struct stat st;
+	mode_t mask;
+
+	if(stat(file, &st) == 0)
+		return st.st_mode & 07777;
+
+	mask = umask(0);
+	umask(mask);
+
+	return STATE_MODE & ~mask;
+}
+
+/* Store the entry for the given key, keeping the other loggers' lines */
+int state_save(const char *file, const char *key, const struct state_entry *s)
+{
+	char line[STATE_LINE_SIZE], k[STATE_KEY_SIZE], *tmp;
+	struct state_entry e;
+	FILE *in, *out;
+	int fd, r;
+
+	if(strpbrk(key, "\t\n") != NULL || strlen(key) >= STATE_KEY_SIZE) {
+		print("Warning: Can't keep state for '%s'\n", key);
+		return -1;
+	}
+
+	if(asprintf(&tmp, "%s.XXXXXX", file) < 0)
+		return -1;
+
+	/* mkstemp() creates the file readable by its owner only */
+	if((fd = mkstemp(tmp)) < 0 || fchmod(fd, state_mode(file)) < 0 || (out = fdopen(fd, "w")) == NULL) {
+		print("Warning: Couldn't create temporary state file '%s'\n", tmp);
+
+		if(fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+
+		free(tmp);
+		return -1;
+	}
+
+	if((in = fopen(file, "r")) != NULL) {
+		while(fgets(line, sizeof(line), in) != NULL)
+			if(state_parse(line, k, &e) == 0 && strcmp(k, key))
+				fputs(line, out);
+
+		fclose(in);
+	}
+
+	fprintf(out, "%s\t" STATE_FORMAT "\n", key, s->memory_pointer,
+			s->filled_locations, s->locations_per_array, s->rtt,
+			s->chunk_size, s->baud, s->aligned_start, s->aligned_back,
+			s->gap_start, s->gap_count);
+
+	r = fflush(out) != 0 || fsync(fileno(out)) < 0;
+
+	if(fclose(out) != 0 || r || rename(tmp, file) < 0) {
+		print("Warning: Couldn't update state file '%s'\n", file);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	free(tmp);
+
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*
+   state.h - What earlier sessions learnt about each datalogger
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef STATE_H
+#define STATE_H
+
+/* STATE_KEY_SIZE is the longest key kept for a logger, such as
+   "tcp:logger.example.org:2030" or "modem:555 1234".  Keys may hold spaces
+   but not tabs or newlines. */
+#define STATE_KEY_SIZE		256
+
+/* Everything remembered about one logger.  Values that were never learnt
+   are zero. */
+struct state_entry {
+	int valid;			/* Loaded from the file */
+	int memory_pointer;		/* MPTR when last seen */
+	int filled_locations;
+	int locations_per_array;
+	int rtt;			/* Round trip in ms */
+	int chunk_size;			/* Data read size that was settled on */
+	int baud;
+	int aligned_start;		/* A location known to begin a record */
+	int aligned_back;		/* Start of the record before it, 0 if unknown */
+	int gap_start, gap_count;	/* Older locations a download that was cut
+					   short never fetched, to be read later */
+};
+
+int state_load(const char *file, const char *key, struct state_entry *s);
+int state_save(const char *file, const char *key, const struct state_entry *s);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+   bench.c - Timings of the hot loops against their simple versions
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deadline.h"
+#include "format_data.h"
+#include "logger.h"
+#include "scan.h"
+#include "xmalloc.h"
+#include "reference.h"
+
+/* The checksum is timed over this many bytes, read as 2048 byte chunks */
+#define BENCH_CHECKSUM_BYTES	(256 << 20)
+#define BENCH_CHECKSUM_CHUNK	2048
+
+/* The formatter is timed over this many locations of logger-like data:
+   arrays of BENCH_ARRAY_LENGTH locations, each a header, a hi-res value and
+   low-res values with up to three decimals */
+#define BENCH_FORMAT_LOCATIONS	(2 << 20)
+#define BENCH_ARRAY_LENGTH	10
+
+/* The word scan is timed over the same kind of data, BENCH_SCAN_ROUNDS
+   times over so it runs long enough to measure */
+#define BENCH_SCAN_ROUNDS	64
+
+/* How the formatter classified every location before the scan kernels: a
+   table lookup on the high byte, bit 0 for special words and bit 1 for
+   array headers */
+#define BENCH_KIND(b)	((((b) & 0x1c) == 0x1c) | (((b) & 0xfc) == 0xfc) << 1)
+#define BENCH_KIND4(b)	BENCH_KIND(b), BENCH_KIND((b) + 1), BENCH_KIND((b) + 2), BENCH_KIND((b) + 3)
+#define BENCH_KIND16(b)	BENCH_KIND4(b), BENCH_KIND4((b) + 4), BENCH_KIND4((b) + 8), BENCH_KIND4((b) + 12)
+#define BENCH_KIND64(b)	BENCH_KIND16(b), BENCH_KIND16((b) + 16), BENCH_KIND16((b) + 32), BENCH_KIND16((b) + 48)
+
+static const uint8_t bench_kind[256] = {
+	BENCH_KIND64(0), BENCH_KIND64(64), BENCH_KIND64(128), BENCH_KIND64(192)
+};
+
+/* The checksum as it was first written, one byte per call */
+static void bench_checksum_add_byte(uint8_t s[2], uint8_t byte)
+{
+	uint8_t t1, t2;
+
+	t1 = s[1];
+	s[1] = s[0];
+	t2 = (s[0] << 1) | ((s[0] & 0x80) >> 7);
+	s[0] = t2 + t1 + byte;
+}
+
+static void bench_checksum_bytes(uint8_t s[2], const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		bench_checksum_add_byte(s, data[i]);
+}
+
+static void bench_report(const char *what, size_t bytes, int64_t ms)
+{
+	if(ms < 1)
+		ms = 1;
+
+	printf("%-32s %6" PRId64 " ms %8.1f MB/s\n", what, ms, bytes / 1000.0 / ms);
+}
+
+/* Time logger_checksum_add() against the byte at a time loop, after
+   checking that both agree on every length up to a few unrolled rounds */
+static int bench_checksum()
+{
+	uint8_t *data = xmalloc(BENCH_CHECKSUM_CHUNK), a[2], b[2];
+	int64_t began;
+	size_t i, n;
+
+	for(i = 0; i < BENCH_CHECKSUM_CHUNK; i++)
+		data[i] = rand();
+
+	for(n = 0; n < 64; n++) {
+		a[0] = a[1] = b[0] = b[1] = 0xAA;
+		bench_checksum_bytes(a, data, n);
+		logger_checksum_add(b, data, n);
+
+		if(a[0] != b[0] || a[1] != b[1]) {
+			printf("logger_checksum_add() differs over %zu bytes\n", n);
+			xfree(data);
+			return -1;
+		}
+	}
+
+	a[0] = a[1] = 0xAA;
+	began = monotonic_ms();
+	for(i = 0; i < BENCH_CHECKSUM_BYTES; i += BENCH_CHECKSUM_CHUNK)
+		bench_checksum_bytes(a, data, BENCH_CHECKSUM_CHUNK);
+	bench_report("checksum, byte at a time", BENCH_CHECKSUM_BYTES, monotonic_ms() - began);
+
+	b[0] = b[1] = 0xAA;
+	began = monotonic_ms();
+	for(i = 0; i < BENCH_CHECKSUM_BYTES; i += BENCH_CHECKSUM_CHUNK)
+		logger_checksum_add(b, data, BENCH_CHECKSUM_CHUNK);
+	bench_report("checksum, logger_checksum_add", BENCH_CHECKSUM_BYTES, monotonic_ms() - began);
+
+	xfree(data);
+
+	return a[0] == b[0] && a[1] == b[1] ? 0 : -1;
+}
+
+/* BENCH_FORMAT_LOCATIONS of logger-like data */
+static uint8_t *bench_logger_data()
+{
+	uint8_t *data = xmalloc(2 * BENCH_FORMAT_LOCATIONS), *p;
+	size_t i;
+
+	for(i = 0, p = data; i < BENCH_FORMAT_LOCATIONS; i++, p += 2) {
+		switch(i % BENCH_ARRAY_LENGTH) {
+			case 0:
+				p[0] = 0xfc;
+				p[1] = 101;
+				break;
+			case 1:
+				p[0] = 0x9c | (rand() & 0x41);
+				p[1] = rand();
+				break;
+			case 2:
+				p[0] = 0x3c | (rand() & 0x01);
+				p[1] = rand();
+				break;
+			default:
+				p[0] = (rand() & 0xe0) | (rand() & 0x1f) % 0x1c;
+				p[1] = rand();
+		}
+	}
+
+	return data;
+}
+
+/* Time process_data() against the fprintf() formatter it replaced.
+   test_format checks that the two write the same. */
+static int bench_format()
+{
+	uint8_t *data = bench_logger_data();
+	int64_t began;
+	FILE *out;
+
+	if((out = fopen("/dev/null", "w")) == NULL) {
+		perror("/dev/null");
+		xfree(data);
+		return -1;
+	}
+
+	began = monotonic_ms();
+	reference_process_data(out, data, 2 * BENCH_FORMAT_LOCATIONS);
+	bench_report("format, fprintf", 2 * BENCH_FORMAT_LOCATIONS, monotonic_ms() - began);
+
+	began = monotonic_ms();
+	process_data(out, data, 2 * BENCH_FORMAT_LOCATIONS, 1);
+	bench_report("format, process_data", 2 * BENCH_FORMAT_LOCATIONS, monotonic_ms() - began);
+
+	fclose(out);
+	xfree(data);
+
+	return 0;
+}
+
+/* Classify a block one location at a time through the table */
+static uint64_t bench_scan_table(const uint8_t *buffer, uint64_t *headers)
+{
+	uint64_t special = 0, header = 0;
+	uint8_t k;
+	int i;
+
+	for(i = 0; i < SCAN_BLOCK; i++) {
+		k = bench_kind[buffer[i * 2]];
+		special |= (uint64_t)(k & 1) << i;
+		header |= (uint64_t)(k >> 1) << i;
+	}
+
+	*headers = header;
+
+	return special;
+}
+
+/* Run a block classifier over the data, folding the masks together so
+   different classifiers can be checked against each other */
+static uint64_t bench_scan_run(const char *what, scan_t scan, const uint8_t *data)
+{
+	uint64_t sum = 0, s, h;
+	int64_t began;
+	size_t i;
+	int r;
+
+	began = monotonic_ms();
+	for(r = 0; r < BENCH_SCAN_ROUNDS; r++) {
+		for(i = 0; i + SCAN_BLOCK <= BENCH_FORMAT_LOCATIONS; i += SCAN_BLOCK) {
+			s = scan(data + i * 2, &h);
+			sum = (sum << 1 | sum >> 63) ^ s ^ h * 3;
+		}
+	}
+	bench_report(what, (size_t)BENCH_SCAN_ROUNDS * 2 * BENCH_FORMAT_LOCATIONS, monotonic_ms() - began);
+
+	return sum;
+}
+
+/* Time each scan kernel the CPU supports against the table lookup it
+   replaced.  test_scan checks the kernels location by location. */
+static int bench_scan()
+{
+	static const char *names[SCAN_KERNELS] = {
+		"scan, scalar kernel", "scan, SSE2 kernel", "scan, AVX2 kernel"
+	};
+	uint8_t *data = bench_logger_data();
+	uint64_t want;
+	scan_t kernel;
+	int k, r = 0;
+
+	want = bench_scan_run("scan, word kind table", bench_scan_table, data);
+
+	for(k = 0; k < SCAN_KERNELS; k++) {
+		if((kernel = scan_kernel_get(k)) == NULL)
+			continue;
+
+		if(bench_scan_run(names[k], kernel, data) != want) {
+			printf("The %s differs from the table\n", names[k]);
+			r = -1;
+		}
+	}
+
+	xfree(data);
+
+	return r;
+}
+
+int main()
+{
+	if(bench_checksum() < 0)
+		return 1;
+
+	if(bench_format() < 0)
+		return 1;
+
+	if(bench_scan() < 0)
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,320 @@
+/*
+   sim.c - A simulated datalogger on the far end of fd_init_mem()
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "xmalloc.h"
+
+/* Longest command the simulated logger accepts */
+#define SIM_COMMAND_LENGTH	64
+
+/* The security reply carries a byte sum of the reply modulo this */
+#define SIM_SUM_MODULO		8192
+
+/* Fill final storage with arrays.  Each array is a header followed by low
+   resolution values, with a high resolution pair in the middle so every
+   kind of word shows up in a download. */
+static void sim_fill(sim_t s)
+{
+	int location, i, id = 0, v;
+	uint8_t *p;
+
+	for(location = 1; location <= s->filled; location++) {
+		p = sim_location(s, location);
+		i = (location - 1) % s->array_length;
+		v = (location * 37) % 8000;
+
+		if(i == 0) {
+			p[0] = 0xfc | ((id >> 8) & 3);
+			p[1] = id & 0xff;
+		} else if(i == 5 && s->array_length > 6) {
+			p[0] = 0x9c;
+			p[1] = 0x12;
+		} else if(i == 6 && s->array_length > 6) {
+			p[0] = 0x3d;
+			p[1] = 0x34;
+		} else {
+			p[0] = ((v >> 8) & 0x1f) | (location % 4) << 5 | (location % 7 ? 0 : 0x80);
+			p[1] = v & 0xff;
+		}
+
+		if(i == s->array_length - 1)
+			id = (id + 1) % 1000;
+	}
+}
+
+sim_t sim_create(int filled, int array_length, int reference)
+{
+	sim_t s = ALLOC(sim);
+
+	memset(s, 0, sizeof(struct sim));
+
+	s->fd = -1;
+	s->filled = filled;
+	s->array_length = array_length;
+	s->reference = reference;
+	s->mptr = reference;
+	s->memory = xmalloc(2 * (filled + 1));
+
+	sim_fill(s);
+
+	return s;
+}
+
+uint8_t *sim_location(sim_t s, int location)
+{
+	return s->memory + 2 * location;
+}
+
+static int sim_wrap(sim_t s, int location)
+{
+	while(location > s->filled)
+		location -= s->filled;
+
+	while(location < 1)
+		location += s->filled;
+
+	return location;
+}
+
+/* The other end may hang up with a reply still on its way, as it does
+   after the prompt that ends a pipelined read, and that must not kill the
+   test with SIGPIPE */
+static void sim_send(sim_t s, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	ssize_t r;
+
+	while(len > 0) {
+		if((r = send(s->fd, p, len, MSG_NOSIGNAL)) < 0)
+			return;
+
+		p += r;
+		len -= r;
+	}
+}
+
+static void sim_print(sim_t s, const char *format, ...)
+{
+	char buf[128];
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+
+	sim_send(s, buf, strlen(buf));
+}
+
+static void sim_checksum_add(uint8_t c[2], const uint8_t *data, size_t len)
+{
+	uint8_t t;
+
+	for(; len > 0; data++, len--) {
+		t = c[0];
+		c[0] = (c[0] << 1 | c[0] >> 7) + c[1] + *data;
+		c[1] = t;
+	}
+}
+
+/* Send locations from MPTR onwards, followed by their checksum */
+static void sim_read(sim_t s, int locations)
+{
+	uint8_t *buf = xmalloc(2 * locations + 2), c[2] = { 0xAA, 0xAA };
+	int i, location;
+
+	for(i = 0; i < locations; i++) {
+		location = sim_wrap(s, s->mptr + i);
+		memcpy(buf + 2 * i, sim_location(s, location), 2);
+
+		sim_checksum_add(c, buf + 2 * i, 2);
+
+		/* The checksum covers what should have been sent */
+		if(location == s->corrupt) {
+			buf[2 * i + 1] ^= 0x10;
+			s->corrupt = 0;
+		}
+	}
+
+	buf[2 * locations] = c[1];
+	buf[2 * locations + 1] = c[0];
+
+	s->mptr = sim_wrap(s, s->mptr + locations);
+	s->reads++;
+	s->locations += locations;
+
+	sim_send(s, buf, 2 * locations + 2);
+	sim_print(s, "\r\n*");
+
+	xfree(buf);
+}
+
+/* Reply to the security command with level 3 and the byte sum of the
+   reply, echo included, up to and including the C */
+static void sim_security(sim_t s, const char *cmd)
+{
+	char buf[SIM_COMMAND_LENGTH + 16];
+	unsigned int sum = 0;
+	char *p;
+
+	if(s->silent == 'L')
+		snprintf(buf, sizeof(buf), "S3 C");
+	else
+		snprintf(buf, sizeof(buf), "%s\r\nS3 C", cmd);
+
+	for(p = buf; *p != '\0'; p++)
+		sum = (sum + (uint8_t)*p) % SIM_SUM_MODULO;
+
+	sim_print(s, "S3 C%04u\r\n*", sum);
+}
+
+static void sim_command(sim_t s, const char *cmd, size_t len)
+{
+	int arg = atoi(cmd);
+
+	s->commands++;
+
+	if(s->latency > 0)
+		usleep(s->latency * 1000);
+
+	if(cmd[len - 1] == s->hang)
+		return;
+
+	if(cmd[len - 1] != s->silent)
+		sim_print(s, "%s\r\n", cmd);
+
+	switch(cmd[len - 1]) {
+		case 'A':
+			sim_print(s, "R+%05d. F+%05d. L+%05d. E+00\r\n*", s->reference, s->filled, s->mptr);
+			break;
+		case 'B':
+			/* Back to the start of the array before MPTR */
+			s->mptr = sim_wrap(s, s->mptr - 1);
+			s->mptr = (s->mptr - 1) / s->array_length * s->array_length + 1;
+			sim_print(s, "L+%05d.\r\n*", s->mptr);
+			break;
+		case 'G':
+			s->mptr = sim_wrap(s, arg);
+			sim_print(s, "L+%05d.\r\n*", s->mptr);
+			break;
+		case 'C':
+			sim_print(s, "D289 T12:34:56\r\n*");
+			break;
+		case 'L':
+			sim_security(s, cmd);
+			break;
+		case 'F':
+			sim_read(s, arg);
+			break;
+		default:
+			sim_print(s, "*");
+	}
+}
+
+/* Commands end in CR and a CR on its own asks for a prompt.  LFs carry no
+   meaning.  Once the logger has had die_after reads the simulation stops
+   answering, as a logger does when the line drops, but keeps draining the
+   connection until the other end closes it. */
+static void *sim_run(void *arg)
+{
+	sim_t s = arg;
+	char cmd[SIM_COMMAND_LENGTH];
+	size_t n = 0;
+	char c;
+
+	while(read(s->fd, &c, 1) == 1) {
+		if(s->die_after > 0 && s->reads >= s->die_after)
+			continue;
+
+		if(c == '\n')
+			continue;
+
+		if(c != '\r') {
+			if(n < sizeof(cmd) - 1)
+				cmd[n++] = c;
+
+			continue;
+		}
+
+		if(n == 0) {
+			s->prompts++;
+			sim_print(s, "\r\n*");
+			continue;
+		}
+
+		cmd[n] = '\0';
+		sim_command(s, cmd, n);
+		n = 0;
+	}
+
+	return NULL;
+}
+
+/* Start answering on a new connection.  The returned descriptor is the
+   logger's end; closing it ends the simulation. */
+fd_t sim_start(sim_t s)
+{
+	fd_t f;
+
+	if((f = fd_init_mem(&s->fd)) == NULL)
+		return NULL;
+
+	if(pthread_create(&s->thread, NULL, sim_run, s) != 0) {
+		close(s->fd);
+		fd_destroy(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+/* Wait for the logger's end to be closed */
+void sim_wait(sim_t s)
+{
+	pthread_join(s->thread, NULL);
+	close(s->fd);
+	s->fd = -1;
+}
+
+void sim_destroy(sim_t s)
+{
+	xfree(s->memory);
+	xfree(s);
+}
@@ -0,0 +1,77 @@
+/*
+   sim.h - A simulated datalogger on the far end of fd_init_mem()
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <pthread.h>
+#include <inttypes.h>
+
+#include "fd.h"
+
+/* The simulated logger's final storage is made of arrays of a fixed length,
+   each starting with an output array ID header word and holding a mix of
+   low and high resolution values.  It answers the A, B, C, G, F and L
+   commands the way a CR10 does, echoing every command first. */
+typedef struct sim {
+	int fd;
+	pthread_t thread;
+
+	int filled;		/* Final storage locations */
+	int array_length;	/* Locations per array */
+	int reference;		/* Where the next array will be written */
+	int mptr;		/* Memory pointer */
+	uint8_t *memory;	/* Two bytes per location, location 1 first */
+
+	/* Faults to inject.  A corrupt location has one bit flipped in the
+	   next F reply that covers it, after which it is sent correctly. */
+	int corrupt;		/* Location to corrupt once, 0 for none */
+	int die_after;		/* Go silent after this many F commands, 0 never */
+	char silent;		/* Command letter not to echo, 0 for none */
+	char hang;		/* Command letter never answered, 0 for none */
+	int latency;		/* Milliseconds before answering a command */
+
+	/* What the logger side asked for.  Only valid after sim_wait(). */
+	unsigned int prompts;	/* Bare CRLFs */
+	unsigned int commands;	/* Everything else, including F */
+	unsigned int reads;	/* F commands */
+	unsigned int locations;	/* Locations sent in reply to F */
+} *sim_t;
+
+sim_t sim_create(int filled, int array_length, int reference);
+fd_t sim_start(sim_t s);
+void sim_wait(sim_t s);
+void sim_destroy(sim_t s);
+uint8_t *sim_location(sim_t s, int location);
+
+#endif
@@ -0,0 +1,340 @@
+/*
+   test_download.c - Whole downloads from the simulated logger
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "download.h"
+#include "format_data.h"
+#include "output.h"
+#include "state.h"
+#include "xmalloc.h"
+#include "sim.h"
+
+/* Shape of the simulated final storage, as in test_logger.c */
+#define SIM_FILLED		20000
+#define SIM_ARRAY_LENGTH	10
+#define SIM_REFERENCE		12341
+
+/* Exchanges a standard download of all of final storage may take: one
+   prompt, A, B for the array length, G and B to align the start and a G
+   where the download wraps.  Then 21 F, as the 7569 locations before the
+   wrap and the 12340 after it are read in pieces of up to 4096 locations,
+   each in chunks of up to 1024. */
+#define STANDARD_EXCHANGES	27
+
+/* A download of all of final storage starts at the array before the
+   reference plus MAX_RECORD_SIZE.  Fetching the newest data first and cut
+   short after 4096 locations, it misses everything from there up to
+   location 8251, where the first array within those 4096 starts. */
+#define BACKFILL_START		(SIM_REFERENCE + 100 - SIM_ARRAY_LENGTH)
+#define BACKFILL_GAP		(SIM_FILLED - BACKFILL_START + 8251 - 1)
+
+/* How long the download against a logger that stops answering may take */
+#define DEADLINE_SECONDS	5
+
+/* Most connection attempts the deadline may be spent on when none of them
+   succeed, with the waits between them doubling */
+#define DEADLINE_CONNECTS	8
+
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+	if(!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++;						\
+	}								\
+} while(0)
+
+/* Connect to the simulated logger, once */
+static fd_t test_connect(void *cd, deadline_t deadline)
+{
+	sim_t s = cd;
+
+	(void)deadline;
+
+	if(s->fd != -1)
+		return NULL;
+
+	return sim_start(s);
+}
+
+/* Count connection attempts, none of which succeed */
+static fd_t test_refuse(void *cd, deadline_t deadline)
+{
+	(*(int *)cd)++;
+
+	(void)deadline;
+
+	return NULL;
+}
+
+/* Every exchange is a round trip, which on a slow link costs about as much
+   as a kilobyte of data, so a download must not pick up extra ones */
+static void test_exchanges()
+{
+	sim_t s = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+	struct download_opts o;
+	FILE *out = tmpfile();
+	unsigned int exchanges;
+
+	memset(&o, 0, sizeof(o));
+	o.start_location = -1;
+	o.threads = 1;
+
+	CHECK(download_connect(out, test_connect, s, "sim", &o) == SIM_REFERENCE);
+
+	sim_wait(s);
+
+	exchanges = s->prompts + s->commands;
+
+	if(exchanges > STANDARD_EXCHANGES)
+		fprintf(stderr, "Standard download took %u exchanges, expected at most %d\n",
+				exchanges, STANDARD_EXCHANGES);
+
+	CHECK(exchanges <= STANDARD_EXCHANGES);
+
+	fclose(out);
+	sim_destroy(s);
+}
+
+/* The state file remembers where the next download starts, under a key
+   with spaces in it, so resuming from the last end needs no alignment */
+static void test_resume()
+{
+	char file[] = "/tmp/crget-state-XXXXXX", *key = "modem:555 1234";
+	sim_t s = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+	struct download_opts o;
+	struct state_entry st;
+	FILE *out = tmpfile();
+	int fd;
+
+	if((fd = mkstemp(file)) < 0) {
+		CHECK(fd >= 0);
+		return;
+	}
+
+	close(fd);
+
+	memset(&o, 0, sizeof(o));
+	o.start_location = -1;
+	o.state_file = file;
+	o.threads = 1;
+
+	CHECK(download_connect(out, test_connect, s, key, &o) == SIM_REFERENCE);
+	sim_wait(s);
+	sim_destroy(s);
+
+	CHECK(state_load(file, key, &st) == 0);
+	CHECK(st.valid);
+	CHECK(st.aligned_start == SIM_REFERENCE);
+	CHECK(st.aligned_back == SIM_REFERENCE - SIM_ARRAY_LENGTH);
+
+	/* Only the last array is read again: A, a G to its start and one F,
+	   after the prompt */
+	s = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+	o.start_location = SIM_REFERENCE;
+
+	CHECK(download_connect(out, test_connect, s, key, &o) == SIM_REFERENCE);
+	sim_wait(s);
+
+	CHECK(s->prompts + s->commands == 4);
+	CHECK(s->locations == SIM_ARRAY_LENGTH);
+
+	sim_destroy(s);
+	fclose(out);
+	unlink(file);
+}
+
+/* Whether out holds exactly what process_data() makes of each of the
+   count ranges of locations in turn */
+static int test_output(FILE *out, sim_t s, const int *from, const int *locations, int count)
+{
+	char *text = NULL, *got;
+	size_t len = 0;
+	FILE *expect;
+	long size;
+	int i, same;
+
+	if((expect = open_memstream(&text, &len)) == NULL)
+		return 0;
+
+	for(i = 0; i < count; i++)
+		process_data(expect, sim_location(s, from[i]), 2 * locations[i], 1);
+
+	fclose(expect);
+
+	fflush(out);
+	size = ftell(out);
+	got = xmalloc(size + 1);
+	rewind(out);
+
+	same = fread(got, 1, size, out) == (size_t)size && (size_t)size == len && !memcmp(got, text, len);
+
+	xfree(got);
+	free(text);
+
+	return same;
+}
+
+/* A download fetching the newest data first that is cut short records the
+   older part it never got, and the next one reads it and writes it out
+   before its own data, so the output stays in order */
+static void test_backfill()
+{
+	char file[] = "/tmp/crget-state-XXXXXX", *key = "sim";
+	sim_t s = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+	struct download_opts o;
+	struct state_entry st;
+	FILE *out = tmpfile();
+	int from[3] = { BACKFILL_START, 1, SIM_REFERENCE - SIM_ARRAY_LENGTH };
+	int locations[3] = { SIM_FILLED - BACKFILL_START, BACKFILL_GAP - (SIM_FILLED - BACKFILL_START), SIM_ARRAY_LENGTH };
+	int fd;
+
+	if((fd = mkstemp(file)) < 0) {
+		CHECK(fd >= 0);
+		return;
+	}
+
+	close(fd);
+
+	memset(&o, 0, sizeof(o));
+	o.start_location = -1;
+	o.state_file = file;
+	o.newest_first = 1;
+	o.threads = 1;
+
+	/* The line drops after the newest 4096 locations, and the logger
+	   can't be reached again.  The failed attempts are reported on
+	   stderr. */
+	s->die_after = 4;
+
+	CHECK(download_connect(out, test_connect, s, key, &o) == SIM_REFERENCE);
+	sim_wait(s);
+	sim_destroy(s);
+
+	CHECK(state_load(file, key, &st) == 0);
+	CHECK(st.gap_start == BACKFILL_START);
+	CHECK(st.gap_count == BACKFILL_GAP);
+
+	s = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+	o.start_location = SIM_REFERENCE;
+
+	fclose(out);
+	out = tmpfile();
+
+	CHECK(download_connect(out, test_connect, s, key, &o) == SIM_REFERENCE);
+	sim_wait(s);
+
+	CHECK(s->locations == SIM_ARRAY_LENGTH + BACKFILL_GAP);
+
+	/* The older part of the gap wraps around the end of final storage */
+	CHECK(test_output(out, s, from, locations, 3));
+	CHECK(state_load(file, key, &st) == 0);
+	CHECK(st.gap_count == 0);
+
+	sim_destroy(s);
+	fclose(out);
+	unlink(file);
+}
+
+/* A deadline bounds the exchanges before the data as well.  The logger
+   never answers the status query, and the response timeout alone would
+   wait far longer than the whole download may take. */
+static void test_deadline()
+{
+	sim_t s = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+	struct download_opts o;
+	FILE *out = tmpfile();
+	int64_t started;
+
+	memset(&o, 0, sizeof(o));
+	o.start_location = -1;
+	o.threads = 1;
+	o.deadline = DEADLINE_SECONDS;
+
+	s->hang = 'A';
+	setenv("RESPONSE_TIMEOUT", "60000", 1);
+
+	started = monotonic_ms();
+	CHECK(download_connect(out, test_connect, s, "sim", &o) < 0);
+	CHECK(monotonic_ms() - started < DEADLINE_SECONDS * 1000);
+
+	setenv("RESPONSE_TIMEOUT", "300", 1);
+
+	sim_wait(s);
+	sim_destroy(s);
+	fclose(out);
+}
+
+/* A logger that can't be reached is tried again until the deadline, but
+   only every so often.  The failures are reported on stderr. */
+static void test_refused()
+{
+	struct download_opts o;
+	FILE *out = tmpfile();
+	int connects = 0;
+
+	memset(&o, 0, sizeof(o));
+	o.start_location = -1;
+	o.threads = 1;
+	o.deadline = DEADLINE_SECONDS;
+
+	CHECK(download_connect(out, test_refuse, &connects, "refused", &o) < 0);
+	CHECK(connects > 1);
+	CHECK(connects <= DEADLINE_CONNECTS);
+
+	fclose(out);
+}
+
+int main()
+{
+	set_quiet();
+	setenv("HIDE_DOWNLOADBAR", "1", 1);
+	setenv("RESPONSE_TIMEOUT", "300", 1);
+
+	test_exchanges();
+	test_resume();
+	test_backfill();
+	test_deadline();
+	test_refused();
+
+	if(failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,273 @@
+/*
+   test_evloop.c - Event loop tests driving several simulated loggers at once
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "connect.h"
+#include "deadline.h"
+#include "evloop.h"
+#include "fd.h"
+#include "output.h"
+#include "sim.h"
+
+/* Shape of the simulated final storage */
+#define SIM_FILLED		20000
+#define SIM_ARRAY_LENGTH	10
+#define SIM_REFERENCE		12341
+
+/* Each session asks its logger for status SESSION_EXCHANGES times, and
+   every logger takes SESSION_LATENCY to answer.  Driven one at a time the
+   sessions would take SESSIONS times as long as any one of them. */
+#define SESSIONS		4
+#define SESSION_EXCHANGES	8
+#define SESSION_LATENCY		20
+
+/* SESSION_TIMEOUT bounds (in milliseconds) the whole test, so a lost
+   event fails it rather than hanging make check */
+#define SESSION_TIMEOUT		10000
+
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+	if(!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++;						\
+	}								\
+} while(0)
+
+struct session {
+	evloop_t loop;
+	sim_t sim;
+	fd_t f;
+	int exchanges, active;
+	int *left;
+};
+
+/* Take whatever has arrived without waiting, and ask again each time a
+   status reply's prompt comes in */
+static void session_read(fd_t f, uint32_t events, void *arg)
+{
+	struct session *s = (struct session *)arg;
+	char buf[256];
+	ssize_t n, i;
+
+	while((n = fd_buffer_count(f)) > 0) {
+		if(n > (ssize_t)sizeof(buf))
+			n = sizeof(buf);
+
+		if(fd_read(f, buf, n, deadline_after(0)) < 0) {
+			CHECK(!"read failed");
+			break;
+		}
+
+		for(i = 0; i < n; i++) {
+			if(buf[i] != '*')
+				continue;
+
+			if(++s->exchanges < SESSION_EXCHANGES) {
+				fd_write(f, "A\r", 2);
+				continue;
+			}
+
+			fd_detach(f);
+			s->active = 0;
+
+			if(--*s->left == 0)
+				evloop_stop(s->loop);
+		}
+	}
+
+	if(n < 0 || (events & EVLOOP_ERROR)) {
+		CHECK(!"session failed");
+		fd_detach(f);
+	}
+}
+
+static void session_timeout(void *arg)
+{
+	evloop_t e = (evloop_t)arg;
+
+	CHECK(!"sessions timed out");
+	evloop_stop(e);
+}
+
+/* Several sessions share one thread, each answered as its replies arrive */
+static void test_sessions()
+{
+	struct session s[SESSIONS];
+	int i, left = SESSIONS;
+	int64_t start;
+	evloop_t e;
+
+	if((e = evloop_create()) == NULL) {
+		CHECK(e != NULL);
+		return;
+	}
+
+	for(i = 0; i < SESSIONS; i++) {
+		s[i].sim = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+		s[i].sim->latency = SESSION_LATENCY;
+		s[i].loop = e;
+		s[i].exchanges = 0;
+		s[i].left = &left;
+
+		if((s[i].f = sim_start(s[i].sim)) == NULL) {
+			fprintf(stderr, "Couldn't start the simulated logger\n");
+			exit(1);
+		}
+
+		CHECK(fd_attach(s[i].f, e, EVLOOP_READ, session_read, &s[i]) == 0);
+		s[i].active = 1;
+	}
+
+	evloop_timer_add(e, SESSION_TIMEOUT, session_timeout, e);
+
+	start = monotonic_ms();
+
+	for(i = 0; i < SESSIONS; i++)
+		fd_write(s[i].f, "A\r", 2);
+
+	CHECK(evloop_run(e) == 0);
+	CHECK(left == 0);
+	CHECK(monotonic_ms() - start < SESSIONS * SESSION_EXCHANGES * SESSION_LATENCY);
+
+	for(i = 0; i < SESSIONS; i++) {
+		CHECK(!s[i].active);
+		CHECK(s[i].exchanges == SESSION_EXCHANGES);
+
+		fd_destroy(s[i].f);
+		sim_wait(s[i].sim);
+
+		CHECK(s[i].sim->commands == SESSION_EXCHANGES);
+		sim_destroy(s[i].sim);
+	}
+
+	evloop_destroy(e);
+}
+
+static int fired[4], nfired;
+
+static void timer_fired(void *arg)
+{
+	fired[nfired++] = *(int *)arg;
+}
+
+/* Timers fire in order of expiry, whatever order they were armed in, and
+   a cancelled one never fires */
+static void test_timers()
+{
+	int id[] = { 0, 1, 2, 3 };
+	evloop_t e;
+
+	if((e = evloop_create()) == NULL) {
+		CHECK(e != NULL);
+		return;
+	}
+
+	nfired = 0;
+	evloop_timer_add(e, 30, timer_fired, &id[3]);
+	evloop_timer_add(e, 10, timer_fired, &id[1]);
+	evloop_timer_cancel(e, evloop_timer_add(e, 20, timer_fired, &id[0]));
+	evloop_timer_add(e, 20, timer_fired, &id[2]);
+
+	CHECK(evloop_run(e) == 0);
+	CHECK(nfired == 3);
+	CHECK(fired[0] == 1 && fired[1] == 2 && fired[2] == 3);
+
+	evloop_destroy(e);
+}
+
+/* connect_tcpip() runs its attempts on an event loop.  It should reach a
+   listening port, whichever of the host's addresses answer, and give up
+   once nothing is listening. */
+static void test_connect()
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	struct tcpip_cd cd;
+	int l, s;
+	fd_t f;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if((l = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	   bind(l, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(l, 1) < 0 ||
+	   getsockname(l, (struct sockaddr *)&sin, &len) < 0) {
+		perror("listen");
+		exit(1);
+	}
+
+	cd.hostname = "localhost";
+	cd.port = ntohs(sin.sin_port);
+
+	CHECK((f = connect_tcpip(&cd, deadline_after(SESSION_TIMEOUT))) != NULL);
+
+	if(f != NULL) {
+		CHECK((s = accept(l, NULL, NULL)) >= 0);
+		CHECK(fd_write(f, "\r", 1) == 1);
+
+		if(s >= 0)
+			close(s);
+
+		fd_destroy(f);
+	}
+
+	close(l);
+
+	CHECK(connect_tcpip(&cd, deadline_after(SESSION_TIMEOUT)) == NULL);
+}
+
+int main()
+{
+	set_quiet();
+
+	test_sessions();
+	test_timers();
+	test_connect();
+
+	if(failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
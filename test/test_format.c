@@ -0,0 +1,202 @@
+/*
+   test_format.c - Checks of the formatter against the fprintf one it replaced
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "format_data.h"
+#include "output.h"
+#include "xmalloc.h"
+#include "reference.h"
+
+/* The hi-res sweep covers every first half, both values of the second
+   half's top bit and every low byte, starting a new array every
+   SWEEP_ARRAY pairs so the data is also split between threads */
+#define SWEEP_ARRAY		256
+#define SWEEP_THREADS		4
+
+/* Fed in pieces, the data is cut at random odd lengths so locations and
+   hi-res pairs are split across calls.  Most pieces are under FEED_SMALL
+   bytes, and one in FEED_LARGE_ODDS is up to FEED_LARGE, enough to be
+   decoded in parallel. */
+#define FEED_SMALL		64
+#define FEED_LARGE		(1 << 19)
+#define FEED_LARGE_ODDS		4
+#define FEED_SEED		2003
+
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+	if(!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++;						\
+	}								\
+} while(0)
+
+/* Decode the data a random odd-sized piece at a time, the way it arrives
+   from the datalogger */
+static void feed_pieces(FILE *out, uint8_t *buffer, size_t len, int threads)
+{
+	decoder_t dec = decoder_create(out, threads);
+	size_t n;
+
+	while(len > 0) {
+		if(rand() % FEED_LARGE_ODDS == 0)
+			n = rand() % (FEED_LARGE / 2) * 2 + 1;
+		else
+			n = rand() % (FEED_SMALL / 2) * 2 + 1;
+
+		if(n > len)
+			n = len;
+
+		decoder_feed(dec, buffer, n);
+		buffer += n;
+		len -= n;
+	}
+
+	decoder_finish(dec);
+}
+
+/* Whether process_data(), or the decoder fed in pieces, writes exactly what
+   the reference does */
+static int test_same(uint8_t *buffer, size_t len, int threads, int pieces)
+{
+	char *a = NULL, *b = NULL;
+	size_t alen = 0, blen = 0, i;
+	FILE *out;
+	int same;
+
+	if((out = open_memstream(&a, &alen)) == NULL)
+		return 0;
+	reference_process_data(out, buffer, len);
+	fclose(out);
+
+	if((out = open_memstream(&b, &blen)) == NULL) {
+		free(a);
+		return 0;
+	}
+	if(pieces)
+		feed_pieces(out, buffer, len, threads);
+	else
+		process_data(out, buffer, len, threads);
+	fclose(out);
+
+	if(!(same = alen == blen && memcmp(a, b, alen) == 0)) {
+		for(i = 0; i < alen && i < blen && a[i] == b[i]; i++)
+			;
+
+		fprintf(stderr, "Output differs from byte %zu: \"%.40s\" against \"%.40s\"\n", i, a + i, b + i);
+	}
+
+	free(a);
+	free(b);
+
+	return same;
+}
+
+/* Every possible word in turn, after an array header.  Most are low-res
+   values, and the rest leave a header, hi-res half or ignored word between
+   them. */
+static void test_words()
+{
+	uint8_t *buffer = xmalloc(2 * 65537), *p = buffer;
+	int w;
+
+	*p++ = 0xfc;
+	*p++ = 0x01;
+
+	for(w = 0; w < 65536; w++) {
+		*p++ = w >> 8;
+		*p++ = w & 0xff;
+	}
+
+	CHECK(test_same(buffer, p - buffer, 1, 0));
+	CHECK(test_same(buffer, p - buffer, 1, 1));
+
+	xfree(buffer);
+}
+
+/* Every hi-res value: each sign, number of decimals and all 17 bits of
+   magnitude.  One high byte of the first half is swept at a time. */
+static void test_hi_res()
+{
+	size_t pairs = 256 * 2 * 256;
+	uint8_t *buffer = xmalloc(2 * (pairs + pairs / SWEEP_ARRAY) * 2), *p;
+	int high, i, top, low, n;
+
+	for(high = 0; high < 256; high++) {
+		if((high & 0x3c) != 0x1c)
+			continue;
+
+		p = buffer;
+		n = 0;
+
+		for(i = 0; i < 256; i++)
+			for(top = 0; top < 2; top++)
+				for(low = 0; low < 256; low++) {
+					if(n++ % SWEEP_ARRAY == 0) {
+						*p++ = 0xfc | (n / SWEEP_ARRAY >> 8 & 0x3);
+						*p++ = n / SWEEP_ARRAY & 0xff;
+					}
+
+					*p++ = high;
+					*p++ = i;
+					*p++ = 0x3c | top;
+					*p++ = low;
+				}
+
+		CHECK(test_same(buffer, p - buffer, 1, 0));
+		CHECK(test_same(buffer, p - buffer, SWEEP_THREADS, 0));
+		CHECK(test_same(buffer, p - buffer, 1, 1));
+		CHECK(test_same(buffer, p - buffer, SWEEP_THREADS, 1));
+	}
+
+	xfree(buffer);
+}
+
+int main()
+{
+	set_quiet();
+	srand(FEED_SEED);
+
+	test_words();
+	test_hi_res();
+
+	if(failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
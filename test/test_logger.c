@@ -0,0 +1,290 @@
+/*
+   test_logger.c - Datalogger protocol tests against the simulated logger
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "output.h"
+#include "xmalloc.h"
+#include "sim.h"
+
+/* Shape of the simulated final storage.  The reference, where MPTR starts,
+   is where the next array will be written. */
+#define SIM_FILLED		20000
+#define SIM_ARRAY_LENGTH	10
+#define SIM_REFERENCE		12341
+
+/* Recovery tests read one chunk of the default size from here.  The
+   failed read takes a G and an F, and recovery a prompt to resynchronise,
+   then a G and F pair for each piece read again. */
+#define RECOVERY_START		1001
+#define RECOVERY_CHUNK		1024
+#define RECOVERY_EXCHANGES(pieces)	(3 + 2 * (pieces))
+
+/* Round trip the simulated logger takes in the recovery test on a slow
+   link, far longer than it takes to send a chunk */
+#define RECOVERY_LATENCY	20
+
+/* A pipelined read of PIPELINE_LOCATIONS takes a G and five F, as many
+   exchanges as one that waits for every prompt.  With the first location of
+   the second chunk corrupted, it takes a prompt to resynchronise, a G and F
+   to read the start of that chunk again, then a G and six F of up to 512
+   and 768 locations. */
+#define PIPELINE_LOCATIONS	5000
+#define PIPELINE_EXCHANGES	6
+#define PIPELINE_RECOVERY	13
+
+/* After a failure halves the chunk, it grows back by 256 locations every
+   four clean reads: four reads of 512 and four of 768 */
+#define REGROWTH_LOCATIONS	(RECOVERY_CHUNK + 4 * 512 + 4 * 768)
+
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+	if(!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++;						\
+	}								\
+} while(0)
+
+static logger_t test_connect(sim_t s)
+{
+	fd_t f;
+
+	if((f = sim_start(s)) == NULL) {
+		fprintf(stderr, "Couldn't start the simulated logger\n");
+		exit(1);
+	}
+
+	return logger_create(f, 0);
+}
+
+/* A whole session: security, clock, position, alignment and a read, with
+   the data compared against what the simulated logger holds */
+static void test_session()
+{
+	sim_t s = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+	int reference, filled, mptr, lpa, start, skew;
+	uint8_t *buf = xmalloc(2 * 5000);
+	logger_t l;
+
+	if((l = test_connect(s)) == NULL) {
+		CHECK(l != NULL);
+		return;
+	}
+
+	CHECK(logger_set_security_level(l, "1234") == 0);
+	CHECK(l->security_level == 3);
+	CHECK(logger_update_clock(l, &skew) == 0);
+
+	CHECK(logger_get_position(l, &reference, &filled, &mptr, &lpa) == 0);
+	CHECK(reference == SIM_REFERENCE);
+	CHECK(filled == SIM_FILLED);
+	CHECK(mptr == SIM_REFERENCE);
+	CHECK(lpa == SIM_ARRAY_LENGTH);
+
+	/* Halfway into an array aligns back to its start */
+	start = SIM_REFERENCE - 95;
+	CHECK(logger_record_align(l, &start) == 0);
+	CHECK(start == SIM_REFERENCE - 100);
+
+	CHECK(logger_read_data(l, buf, start, 5000) == 5000);
+	CHECK(!memcmp(buf, sim_location(s, start), 2 * 5000));
+
+	logger_destroy(l);
+	sim_wait(s);
+
+	CHECK(s->locations == 5000);
+
+	sim_destroy(s);
+	xfree(buf);
+}
+
+/* Security codes aren't limited in length, and the reply carries its own
+   checksum so it is accepted without the echo */
+static void test_security()
+{
+	sim_t s = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+	char code[48];
+	logger_t l;
+
+	memset(code, '7', sizeof(code) - 1);
+	code[sizeof(code) - 1] = '\0';
+	s->silent = 'L';
+
+	if((l = test_connect(s)) == NULL) {
+		CHECK(l != NULL);
+		return;
+	}
+
+	CHECK(logger_set_security_level(l, code) == 0);
+	CHECK(l->security_level == 3);
+
+	logger_destroy(l);
+	sim_wait(s);
+	sim_destroy(s);
+}
+
+/* A location corrupted on the line fails the checksum of the chunk it was
+   read in, and recovery reads part of the chunk again.  The logger answers
+   each command after latency ms, and expected is how many locations that
+   should take in how many exchanges. */
+static void test_recovery(int offset, int latency, unsigned int expected, unsigned int exchanges)
+{
+	sim_t s = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+	uint8_t *buf = xmalloc(2 * RECOVERY_CHUNK);
+	unsigned int round_trips;
+	logger_t l;
+
+	s->corrupt = RECOVERY_START + offset;
+	s->latency = latency;
+
+	if((l = test_connect(s)) == NULL) {
+		CHECK(l != NULL);
+		return;
+	}
+
+	round_trips = l->round_trips;
+
+	CHECK(logger_read_data(l, buf, RECOVERY_START, RECOVERY_CHUNK) == RECOVERY_CHUNK);
+	CHECK(!memcmp(buf, sim_location(s, RECOVERY_START), 2 * RECOVERY_CHUNK));
+	CHECK(l->chunk.failures == 1);
+	CHECK(l->chunk.refetched == expected);
+	CHECK(l->round_trips - round_trips == exchanges);
+
+	logger_destroy(l);
+	sim_wait(s);
+
+	if(s->locations != RECOVERY_CHUNK + expected)
+		fprintf(stderr, "Error at %d: %u locations read again, expected %u\n",
+				offset, s->locations - RECOVERY_CHUNK, expected);
+
+	CHECK(s->locations == RECOVERY_CHUNK + expected);
+
+	sim_destroy(s);
+	xfree(buf);
+}
+
+/* Pipelined reads send each F without waiting for the prompt after the
+   previous one.  After a bad checksum the next command waits for a fresh
+   prompt again, and the data must come out the same either way. */
+static void test_pipeline(int corrupt, unsigned int exchanges, unsigned int prompts)
+{
+	sim_t s = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+	uint8_t *buf = xmalloc(2 * PIPELINE_LOCATIONS);
+	unsigned int round_trips;
+	logger_t l;
+
+	s->corrupt = corrupt;
+
+	if((l = test_connect(s)) == NULL) {
+		CHECK(l != NULL);
+		return;
+	}
+
+	l->pipeline = 1;
+	round_trips = l->round_trips;
+
+	CHECK(logger_read_data(l, buf, RECOVERY_START, PIPELINE_LOCATIONS) == PIPELINE_LOCATIONS);
+	CHECK(!memcmp(buf, sim_location(s, RECOVERY_START), 2 * PIPELINE_LOCATIONS));
+	CHECK(l->round_trips - round_trips == exchanges);
+	CHECK(l->chunk.failures == (corrupt != 0));
+	CHECK(l->state == LOGGER_PROMPT);
+
+	logger_destroy(l);
+	sim_wait(s);
+
+	CHECK(s->prompts == prompts);
+
+	sim_destroy(s);
+	xfree(buf);
+}
+
+/* A failure shrinks the chunk, and clean reads grow it back to the
+   standard size however short the round trip */
+static void test_regrowth()
+{
+	sim_t s = sim_create(SIM_FILLED, SIM_ARRAY_LENGTH, SIM_REFERENCE);
+	uint8_t *buf = xmalloc(2 * REGROWTH_LOCATIONS);
+	logger_t l;
+
+	s->corrupt = RECOVERY_START;
+
+	if((l = test_connect(s)) == NULL) {
+		CHECK(l != NULL);
+		return;
+	}
+
+	CHECK(logger_read_data(l, buf, RECOVERY_START, REGROWTH_LOCATIONS) == REGROWTH_LOCATIONS);
+	CHECK(!memcmp(buf, sim_location(s, RECOVERY_START), 2 * REGROWTH_LOCATIONS));
+	CHECK(l->chunk.failures == 1);
+	CHECK(l->chunk.smallest == RECOVERY_CHUNK / 2);
+	CHECK(l->chunk.size == RECOVERY_CHUNK);
+
+	logger_destroy(l);
+	sim_wait(s);
+	sim_destroy(s);
+	xfree(buf);
+}
+
+int main()
+{
+	set_quiet();
+
+	test_session();
+	test_security();
+
+	/* The chunk is recovered a quarter at a time, alternating between
+	   its ends, until the data left in between checks out or is no more
+	   than half the chunk and read in one go */
+	test_recovery(0, 0, RECOVERY_CHUNK / 4, RECOVERY_EXCHANGES(1));
+	test_recovery(RECOVERY_CHUNK / 2, 0, RECOVERY_CHUNK, RECOVERY_EXCHANGES(3));
+	test_recovery(RECOVERY_CHUNK - 1, 0, RECOVERY_CHUNK / 2, RECOVERY_EXCHANGES(2));
+
+	/* Where round trips cost more than the transfer, it is read again
+	   whole */
+	test_recovery(RECOVERY_CHUNK / 2, RECOVERY_LATENCY, RECOVERY_CHUNK, RECOVERY_EXCHANGES(1));
+	test_regrowth();
+
+	test_pipeline(0, PIPELINE_EXCHANGES, 1);
+	test_pipeline(RECOVERY_START + RECOVERY_CHUNK, PIPELINE_RECOVERY, 2);
+
+	if(failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,191 @@
+/*
+   test_scan.c - Checks of the scan kernels against one location at a time
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+#include "output.h"
+#include "xmalloc.h"
+
+/* The kernels are run over SCAN_TEST_BLOCKS random blocks, laid end to end
+   so every tail length is also cut from them.  Special and header high
+   bytes are made far more common than in real data, so each block has a
+   good mix of both. */
+#define SCAN_TEST_BLOCKS	4096
+#define SCAN_TEST_SEED		2003
+
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+	if(!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++;						\
+	}								\
+} while(0)
+
+static const char *kernel_names[SCAN_KERNELS] = { "scalar", "SSE2", "AVX2" };
+
+/* What scan_block() should return for count locations, worked out one
+   location at a time with the masks straight from the protocol */
+static uint64_t classify(const uint8_t *buffer, size_t count, uint64_t *headers)
+{
+	uint64_t special = 0, header = 0;
+	size_t i;
+
+	for(i = 0; i < count; i++) {
+		if((buffer[i * 2] & 0x1c) == 0x1c)
+			special |= (uint64_t)1 << i;
+
+		if((buffer[i * 2] & 0xfc) == 0xfc)
+			header |= (uint64_t)1 << i;
+	}
+
+	*headers = header;
+
+	return special;
+}
+
+static uint8_t *random_locations(size_t locations)
+{
+	uint8_t *buffer = xmalloc(2 * locations), *p;
+	size_t i;
+
+	for(i = 0, p = buffer; i < locations; i++, p += 2) {
+		switch(rand() % 8) {
+			case 0:
+				p[0] = 0xfc | rand();
+				break;
+			case 1:
+			case 2:
+				p[0] = 0x1c | rand();
+				break;
+			default:
+				p[0] = rand();
+		}
+
+		p[1] = rand();
+	}
+
+	return buffer;
+}
+
+/* Every kernel the CPU can run agrees with the reference on every block,
+   including blocks that don't start on a location boundary */
+static void test_kernels()
+{
+	uint8_t *buffer = random_locations(SCAN_TEST_BLOCKS * SCAN_BLOCK + 1);
+	uint64_t s, h, rs, rh;
+	scan_t kernel;
+	size_t i;
+	int k;
+
+	for(k = 0; k < SCAN_KERNELS; k++) {
+		if((kernel = scan_kernel_get(k)) == NULL) {
+			printf("Skipping the %s kernel, which this CPU lacks\n", kernel_names[k]);
+			continue;
+		}
+
+		for(i = 0; i < SCAN_TEST_BLOCKS; i++) {
+			rs = classify(buffer + i * SCAN_BLOCK * 2, SCAN_BLOCK, &rh);
+			s = kernel(buffer + i * SCAN_BLOCK * 2, &h);
+			CHECK(s == rs && h == rh);
+
+			rs = classify(buffer + i * SCAN_BLOCK * 2 + 1, SCAN_BLOCK, &rh);
+			s = kernel(buffer + i * SCAN_BLOCK * 2 + 1, &h);
+			CHECK(s == rs && h == rh);
+		}
+	}
+
+	xfree(buffer);
+}
+
+/* Short blocks have every length from none to one short of a block */
+static void test_tails()
+{
+	uint8_t *buffer = random_locations(SCAN_TEST_BLOCKS * SCAN_BLOCK);
+	uint64_t s, h, rs, rh;
+	size_t i, n;
+
+	for(i = 0; i < SCAN_TEST_BLOCKS; i++) {
+		n = i % SCAN_BLOCK;
+		rs = classify(buffer + i * SCAN_BLOCK * 2, n, &rh);
+		s = scan_block(buffer + i * SCAN_BLOCK * 2, n, &h);
+		CHECK(s == rs && h == rh);
+	}
+
+	xfree(buffer);
+}
+
+/* The header searches find the same header as a plain loop would, looking
+   either way from every point in a buffer that doesn't end on a block */
+static void test_headers()
+{
+	size_t locations = 16 * SCAN_BLOCK + 17, from, i;
+	uint8_t *buffer = random_locations(locations);
+
+	/* Headers are made sparse, so searches cross whole blocks */
+	for(i = 0; i < locations; i++)
+		if((buffer[i * 2] & 0xfc) == 0xfc && rand() % 32 != 0)
+			buffer[i * 2] = 0;
+
+	for(from = 0; from <= locations; from++) {
+		for(i = from; i < locations && (buffer[i * 2] & 0xfc) != 0xfc; i++)
+			;
+		CHECK(scan_next_header(buffer, from, locations) == i);
+
+		for(i = from; i > 0 && (buffer[(i - 1) * 2] & 0xfc) != 0xfc; i--)
+			;
+		CHECK(scan_prev_header(buffer, from) == (i > 0 ? i - 1 : from));
+	}
+
+	xfree(buffer);
+}
+
+int main()
+{
+	set_quiet();
+	srand(SCAN_TEST_SEED);
+
+	test_kernels();
+	test_tails();
+	test_headers();
+
+	if(failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
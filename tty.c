@@ -0,0 +1,137 @@
+/*
+   tty.c - Terminal line settings shared by serial and modem connections
+   Copyright (C)2002-03 Anthony Arcieri
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+ * Redistributions of source code must retain the above copyright
+ notice, this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright
+ notice, this list of conditions and the following disclaimer in the
+ documentation and/or other materials provided with the distribution.
+
+ * The name of Anthony Arcieri may not be used to endorse or promote 
+ products derived from this software without specific prior written 
+ permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT 
+ OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED 
+ TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+#include "tty.h"
+
+/* TTY_READ_GAP defines (in tenths of a second) how long the line may stay
+ * idle after the first byte of a read before the read returns short.  A
+ * read otherwise only returns once the requested number of bytes, up to
+ * 255, has arrived. */
+#define TTY_READ_GAP	1
+
+/* Convert a baud rate to a termios speed.  Returns B0 for unsupported rates */
+speed_t tty_speed(int baud)
+{
+	switch(baud) {
+		case 300:	return B300;
+		case 1200:	return B1200;
+		case 2400:	return B2400;
+		case 4800:	return B4800;
+		case 9600:	return B9600;
+		case 19200:	return B19200;
+		case 38400:	return B38400;
+		case 57600:	return B57600;
+		case 115200:	return B115200;
+#ifdef B230400
+		case 230400:	return B230400;
+#endif
+#ifdef B460800
+		case 460800:	return B460800;
+#endif
+#ifdef B921600
+		case 921600:	return B921600;
+#endif
+	}
+
+	return B0;
+}
+
+/* Put the line into raw mode, optionally changing its speed (0 keeps the
+   current one).  tio receives the settings now in effect. */
+int tty_raw(int fd, struct termios *tio, int baud)
+{
+	speed_t speed;
+
+	if(tcgetattr(fd, tio) < 0)
+		return -1;
+
+	tio->c_cflag |= CLOCAL | CREAD;
+	tio->c_iflag &= ~(IXON|IXOFF|IXANY);
+	tio->c_iflag &= ~(INLCR|IGNCR|ICRNL);
+	tio->c_lflag &= ~(ICANON|ECHO|ECHOE|ISIG);
+	tio->c_cc[VMIN] = 1;
+	tio->c_cc[VTIME] = 0;
+
+	if(baud > 0) {
+		if((speed = tty_speed(baud)) == B0)
+			return -1;
+
+		cfsetospeed(tio, speed);
+		cfsetispeed(tio, speed);
+	}
+
+	return tcsetattr(fd, TCSANOW, tio);
+}
+
+/* Ask the driver to pass received bytes on immediately rather than
+   batching them.  Not every driver supports this, so failure is harmless. */
+int tty_low_latency(int fd)
+{
+#if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct ss;
+
+	if(ioctl(fd, TIOCGSERIAL, &ss) < 0)
+		return -1;
+
+	ss.flags |= ASYNC_LOW_LATENCY;
+
+	return ioctl(fd, TIOCSSERIAL, &ss);
+#else
+	return -1;
+#endif
+}
+
+/* Set VMIN for the size of the next read, so that a large read wakes us a
+   few times instead of once per byte.  tio must hold the current settings. */
+int tty_read_size(int fd, struct termios *tio, size_t nbytes)
+{
+	cc_t vmin = nbytes > 255 ? 255 : (nbytes < 1 ? 1 : nbytes);
+	cc_t vtime = vmin > 1 ? TTY_READ_GAP : 0;
+
+	if(tio->c_cc[VMIN] == vmin && tio->c_cc[VTIME] == vtime)
+		return 0;
+
+	tio->c_cc[VMIN] = vmin;
+	tio->c_cc[VTIME] = vtime;
+
+	return tcsetattr(fd, TCSANOW, tio);
+}